@@ -13,6 +13,7 @@
 #include <assert.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,7 +28,7 @@ public:
   std::vector<T> samples;
   unsigned int sample_rate;
   unsigned int max_samples;
-  unsigned int total_samples;
+  uint64_t total_samples;   // Seen, not kept.
 
   AdaptiveSampler() = delete;
   AdaptiveSampler(int max) :
@@ -43,13 +44,17 @@ public:
     // Throw out half of the samples, double sample_rate.
     if (samples.size() >= max_samples) {
       sample_rate *= 2;
+      thin(2);
+    }
+  }
 
-      std::vector<T> half_samples;
-      for (unsigned int i = 0; i < samples.size(); i++) {
-        if (drand48() > .5) half_samples.push_back(samples[i]);
-      }
-      samples = half_samples;
+  // Keep each sample with probability 1/n.
+  void thin(unsigned int n) {
+    std::vector<T> kept;
+    for (unsigned int i = 0; i < samples.size(); i++) {
+      if (drand48() < 1 / (double) n) kept.push_back(samples[i]);
     }
+    samples = kept;
   }
 
   void save_samples(const char* type, const char* filename) {
@@ -72,6 +77,57 @@ public:
     return result/length;
   }
 
+  // The statistics ConnectionStats reports, over the samples kept.
+
+  double stddev() {
+    double avg = average(), result = 0.0;
+    for (auto s: samples) result += (s - avg) * (s - avg);
+    return sqrt(result / samples.size());
+  }
+
+  double minimum() {
+    return *std::min_element(samples.begin(), samples.end());
+  }
+
+  double maximum() {
+    return *std::max_element(samples.begin(), samples.end());
+  }
+
+  double get_nth(double nth) {
+    std::vector<T> copy = samples;
+    size_t i = copy.size() * nth / 100;
+
+    if (copy.empty()) return 0.0;
+    if (i >= copy.size()) i = copy.size() - 1;
+    std::nth_element(copy.begin(), copy.begin() + i, copy.end());
+    return copy[i];
+  }
+
+  uint64_t total() {
+    return total_samples;
+  }
+
+  // Each kept sample stands for sample_rate samples seen.  Thin the more
+  // densely sampled side to the other's rate so both weigh the same, then
+  // merge, rather than re-sample h's reservoir as if it were all it saw.
+  void accumulate(const AdaptiveSampler<T> &h) {
+    if (h.sample_rate > sample_rate) {
+      thin(h.sample_rate / sample_rate);
+      sample_rate = h.sample_rate;
+    }
+
+    unsigned int keep = sample_rate / h.sample_rate;
+    for (auto s: h.samples)
+      if (keep == 1 || drand48() < 1 / (double) keep) samples.push_back(s);
+
+    total_samples += h.total_samples;
+
+    while (samples.size() >= max_samples) {
+      thin(2);
+      sample_rate *= 2;
+    }
+  }
+
   void print_header() {
       printf("#%-6s %6s %8s %8s %8s %8s %8s %8s\n", "type", "size",
          "min", "max", "avg", "90th", "95th", "99th");
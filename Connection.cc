@@ -1,10 +1,14 @@
 #include <netinet/tcp.h>
 #include <netinet/in.h>
+#include <sys/un.h>
+#include <math.h>
 
+#include <map>
 #include <string>
 #include <sstream>
 #include <vector>
 
+#include <pthread.h>
 #include <unistd.h>
 
 #include <event2/buffer.h>
@@ -16,6 +20,11 @@
 
 #include "config.h"
 
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#endif
+
 #include "Connection.h"
 #include "Protocol.h"
 
@@ -23,93 +32,155 @@
 #include "Generator.h"
 #include "mutilate.h"
 #include "binary_protocol.h"
+#include "UringEngine.h"
 #include "util.h"
 
+static bool is_up(const server_t* serv) {
+  return serv->read_state != INIT_READ && serv->read_state != CONN_SETUP;
+}
+
+// The BasicConnection serv belongs to, on a thread of policy S.
+template <class S> static BasicConnection<S>* conn_of(server_t* serv) {
+  return static_cast<BasicConnection<S>*>(serv->conn);
+}
+
 /**
  * Create a new connection to a server endpoint.
  */
-Connection::Connection(struct event_base* _base, struct evdns_base* _evdns,
-                       options_t _options, string hosts, bool sampling) :
-  start_time(0), stats(sampling), options(_options), base(_base), evdns(_evdns)
+template <class S>
+BasicConnection<S>::BasicConnection(thread_state_t<S>* _ts, string hosts,
+                                    int _churn_left) :
+  Connection(_ts->options, _ts->stats), stats(_ts->stats), ts(_ts),
+  churn_left(_churn_left), retired(false)
 {
-  valuesize = createGenerator(options.valuesize);
-  keysize = createGenerator(options.keysize);
-  keygen = new KeyGenerator(keysize, options.records);
-
   stringstream ss(hosts);
   string item;
   while (getline(ss, item, '|')) {
     servers.push_back(parse_hoststring(item));
   }
 
-  if (options.lambda <= 0) {
-    iagen = createGenerator("0");
-  } else {
-    D("iagen = createGenerator(%s)", options.ia);
-    iagen = createGenerator(options.ia);
-    iagen->set_lambda(options.lambda);
-  }
-
-  if (sampling && options.reserve > 0) {
-    stats.get_sampler.samples.reserve(
-      options.reserve * (1 - options.update) + 1);
-    stats.set_sampler.samples.reserve(options.reserve * options.update + 1);
-  }
-
   for (auto &s : servers) {
     s.read_state  = INIT_READ;
     s.write_state = INIT_WRITE;
+    s.op_queue.reserve(options.depth);
+    ts->busy++;
+    ts->down++;
   }
 
   last_tx = last_rx = 0.0;
+  last_intended = 0.0;
+  sched_due = 0.0;
+
+  routed = (ts->ring != NULL ||
+            ((options.replicate || options.hedge) && servers.size() > 1)) &&
+    churn_left < 0;
+  in_flight = 0;
+  fanout_head = 1;
+  session_head = 1;
+  backend_waits = 0;
+  migrate_to = NULL;
+  if (routed && ts->ring && servers.size() != ts->ring->size())
+    DIE("--ketama connection has %zu servers, ring has %zu.", servers.size(),
+        ts->ring->size());
 
   set_leader(1);
-  for (server_t &s : servers) {
-    connect_server(s);
-  }
-
-
-  timer = evtimer_new(base, timer_cb, this);
 }
 
 /**
- * Destroy a connection, performing cleanup.
+ * Copy a Connection that --rebalance is moving to another thread.  The
+ * copy takes over from's sockets, fds, once adopt() runs on the thread
+ * that owns _ts.
  */
-Connection::~Connection() {
-  event_free(timer);
-  timer = NULL;
-
-  for (server_t &s : servers) {
-    if (s.bev != NULL) bufferevent_free(s.bev);
-    if (s.prot != NULL) delete s.prot;
+template <class S>
+BasicConnection<S>::BasicConnection(thread_state_t<S>* _ts,
+                                    const BasicConnection<S>& from,
+                                    const vector<evutil_socket_t>& fds) :
+  Connection(_ts->options, _ts->stats), stats(_ts->stats),
+  servers(from.servers), ts(_ts),
+  churn_left(-1), backlog(from.backlog), retired(false),
+  fanouts(from.fanouts), sessions(from.sessions)
+{
+  for (auto &s : servers) {
+    s.conn = this;
+    s.bev = NULL;
+    s.prot = NULL;
+    s.rx_event = NULL;
+    s.reconnect_timer = NULL;
+    s.corked = false;
   }
+  leader = &servers[from.leader - &from.servers[0]];
+
+  next_time = from.next_time;
+  last_tx = from.last_tx;
+  last_rx = from.last_rx;
+  last_intended = from.last_intended;
+  sched_due = 0.0;
+  loader_issued = from.loader_issued;
+  loader_completed = from.loader_completed;
+
+  routed = from.routed;
+  in_flight = from.in_flight;
+  fanout_head = from.fanout_head;
+  session_head = from.session_head;
+  backend_waits = 0; // try_migrate() waits them out.
+  migrate_to = NULL;
+  adopted = fds;
+}
 
-  delete iagen;
-  delete keygen;
-  delete keysize;
-  delete valuesize;
+/**
+ * Start connecting to every server of this connection.
+ */
+template <class S>
+void BasicConnection<S>::connect() {
+  for (server_t &s : servers) connect_server(s);
 }
 
 /**
- * Check that the connection is ready to go.
+ * Destroy a connection, performing cleanup.
  */
-bool Connection::is_ready() {
-  for (auto &s : servers) {
-    if (s.read_state != IDLE) return false;
+template <class S>
+BasicConnection<S>::~BasicConnection() {
+  for (server_t &s : servers) {
+    if (s.read_state != IDLE) ts->busy--;
+    if (!is_up(&s)) ts->down--;
+    if (s.bev != NULL) bufferevent_free(s.bev);
+    if (s.prot != NULL) delete s.prot;
+    if (s.reconnect_timer != NULL) event_free(s.reconnect_timer);
+    if (s.rx_event != NULL) event_free(s.rx_event);
   }
-  return true;
+  for (auto fd : adopted) evutil_closesocket(fd); // Never adopt()ed.
 }
 
 /**
- * Connect to the specified server.
+ * Give a server a bufferevent on fd, or -1 to connect it later, and a
+ * Protocol to speak over it.
  */
-void Connection::connect_server(server_t &serv) {
+template <class S>
+void BasicConnection<S>::attach(server_t &serv, evutil_socket_t fd) {
   struct bufferevent* bev;
   Protocol* prot;
 
-  bev = bufferevent_socket_new(base, -1, BEV_OPT_CLOSE_ON_FREE);
-  bufferevent_setcb(bev, bev_read_cb, bev_write_cb, bev_event_cb, &serv);
-  bufferevent_enable(bev, EV_READ | EV_WRITE);
+  if (ts->uring) {
+    bev = ts->uring->new_bufferevent(serv);
+  } else {
+    bev = bufferevent_socket_new(ts->base, fd, BEV_OPT_CLOSE_ON_FREE);
+    // Under --cork, flush_corked() does the writing and EV_WRITE is only
+    // enabled to drain what a short write left behind.  Under
+    // --timestamping, timestamp_read() does the reading.
+    short enable = options.cork ? EV_READ : EV_READ | EV_WRITE;
+    if (options.timestamping && !serv.unix_socket) enable &= ~EV_READ;
+    bufferevent_enable(bev, enable);
+
+    // Connecting waits on EV_WRITE, so a write timeout bounds it.
+    if (options.connect_timeout > 0 && fd < 0) {
+      struct timeval tv;
+      double_to_tv(options.connect_timeout, &tv);
+      bufferevent_set_timeouts(bev, NULL, &tv);
+    }
+  }
+  bufferevent_setcb(bev, bev_read_cb<S>, bev_write_cb<S>, bev_event_cb<S>,
+                    &serv);
+  evbuffer_add_cb(bufferevent_get_output(bev), bev_output_cb<S>, &serv);
 
   if (options.etcd) {
     prot = new ProtocolEtcd(options, serv, bev);
@@ -125,20 +196,80 @@ void Connection::connect_server(server_t &serv) {
 
   serv.bev  = bev;
   serv.prot = prot;
+}
 
-  if (bufferevent_socket_connect_hostname(bev, evdns, AF_UNSPEC,
-                                          serv.host.c_str(),
-                                          atoi(serv.port.c_str()))) {
-    DIE("bufferevent_socket_connect_hostname()");
+/**
+ * Connect to the specified server.
+ */
+template <class S>
+void BasicConnection<S>::connect_server(server_t &serv) {
+  attach(serv, -1);
+
+  struct bufferevent* bev = serv.bev;
+  serv.connect_start = get_time();
+  ts->connecting++;
+
+  if (ts->uring) {
+    ts->uring->connect(serv, options.connect_timeout);
+  } else if (serv.unix_socket) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, serv.host.c_str());
+
+    if (bufferevent_socket_connect(bev, (struct sockaddr *) &addr,
+                                   sizeof(addr))) {
+      if (!options.reconnect)
+        DIE("bufferevent_socket_connect(%s)", serv.host.c_str());
+      // Deferred, so a dead socket can't recurse through connect_pending().
+      bufferevent_trigger_event(bev, BEV_EVENT_ERROR,
+                                BEV_TRIG_DEFER_CALLBACKS);
+    }
+  } else if (bufferevent_socket_connect_hostname(bev, ts->evdns, AF_UNSPEC,
+                                                 serv.host.c_str(),
+                                                 atoi(serv.port.c_str()))) {
+    if (!options.reconnect)
+      DIE("bufferevent_socket_connect_hostname(%s)", serv.host.c_str());
+    bufferevent_trigger_event(bev, BEV_EVENT_ERROR, BEV_TRIG_DEFER_CALLBACKS);
   }
 }
 
 /**
- * Split host into host:port using strtok().
+ * Split host into host:port using strtok().  A host of the form
+ * unix:<path> names a Unix domain socket instead.
  */
-server_t Connection::parse_hoststring(string s) {
+template <class S>
+server_t BasicConnection<S>::parse_hoststring(string s) {
   static int id = 0;
   server_t serv; 
+
+  serv.conn = this;
+  serv.prot = NULL;
+  serv.bev  = NULL;
+  serv.uring_slot = -1;
+  serv.corked = false;
+  serv.down_since = serv.up_since = 0.0;
+  serv.backoff = 0.0;
+  serv.reconnect_timer = NULL;
+  serv.issued = 0;
+  serv.rx_event = NULL;
+  serv.tx_added = 0;
+  serv.rx_added = 0;
+
+  if (!s.compare(0, 5, "unix:")) {
+    serv.id   = ++id;
+    serv.host = s.substr(5);
+    serv.port = "";
+    serv.name = s;
+    serv.unix_socket = true;
+
+    if (serv.host.empty() ||
+        serv.host.length() >= sizeof(((struct sockaddr_un *) 0)->sun_path))
+      DIE("Invalid Unix socket path: %s", s.c_str());
+
+    return serv;
+  }
+
   char *saveptr = NULL; // For reentrant strtok().
   char *s_copy = new char[s.length() + 1];
   strcpy(s_copy, s.c_str());
@@ -150,9 +281,8 @@ server_t Connection::parse_hoststring(string s) {
   serv.id   = ++id;
   serv.host = name_to_ipaddr(h_ptr);
   serv.port = p_ptr ? p_ptr : "11211";
-  serv.conn = this;
-  serv.prot = NULL;
-  serv.bev  = NULL;
+  serv.name = string(h_ptr) + ":" + serv.port;
+  serv.unix_socket = false;
   delete[] s_copy;
 
   return serv;
@@ -161,7 +291,8 @@ server_t Connection::parse_hoststring(string s) {
 /**
  * Set the leader to use for this connection.
  */
-void Connection::set_leader(unsigned int id) {
+template <class S>
+void BasicConnection<S>::set_leader(unsigned int id) {
   if (0 < id && id <= servers.size()) {
     leader = &servers[id - 1];
   } else {
@@ -172,28 +303,37 @@ void Connection::set_leader(unsigned int id) {
 /**
  * Return the current leader.
  */
-unsigned int Connection::get_leader() {
+template <class S>
+unsigned int BasicConnection<S>::get_leader() {
   return leader->id;
 }
 
 /**
  * Reset the connection back to an initial, fresh state.
  */
-void Connection::reset() {
+template <class S>
+void BasicConnection<S>::reset() {
   // FIXME: Actually check the connection, drain all bufferevents, drain op_q.
   for (auto &s : servers) {
     assert(s.op_queue.size() == 0);
-    s.read_state = IDLE;
+    if (!is_up(&s)) continue; // Still down; --reconnect brings it back.
+    set_read_state(&s, IDLE);
     s.write_state = INIT_WRITE;
   }
-  evtimer_del(timer);
-  stats = ConnectionStats(stats.sampling);
+  while (!backlog.empty()) backlog.pop();
+  // Abandon --cache_aside reads still in a backend fetch.
+  session_head += sessions.size();
+  while (!sessions.empty()) sessions.pop();
+  backend_waits = 0;
+  sched_due = 0.0; // Orphans any scheduler entry.
+  last_intended = 0.0;
 }
 
 /**
  * Set our event processing priority.
  */
-void Connection::set_priority(int pri) {
+template <class S>
+void BasicConnection<S>::set_priority(int pri) {
   for (auto &s : servers) {
     if (bufferevent_priority_set(s.bev, pri)) {
       DIE("bufferevent_set_priority(bev, %d) failed", pri);
@@ -204,27 +344,85 @@ void Connection::set_priority(int pri) {
 /**
  * Load any required test data onto the server.
  */
-void Connection::start_loading() {
+template <class S>
+void BasicConnection<S>::start_loading() {
   for (auto &s : servers) {
-    s.read_state = LOADING;
+    set_read_state(&s, LOADING);
+    if (routed) s.op_queue.reserve(LOADER_CHUNK);
   }
+  leader->op_queue.reserve(LOADER_CHUNK);
   loader_issued = loader_completed = 0;
 
   for (int i = 0; i < LOADER_CHUNK; i++) {
     if (loader_issued >= options.records) break;
     char key[256];
-    int index = lrand48() % (1024 * 1024);
-    string keystr = keygen->generate(loader_issued);
+    string keystr = ts->keygen->generate(loader_issued);
     strcpy(key, keystr.c_str());
-    issue_set(leader, key, &random_char[index], valuesize->generate());
+    load_key(key);
     loader_issued++;
   }
 }
 
+/**
+ * Issue the loader's set for a key: to its --ketama server, to every
+ * replica under --replicate or --hedge, or else to the leader.
+ */
+template <class S>
+void BasicConnection<S>::load_key(const char* key) {
+  int index = lrand48() % (1024 * 1024);
+  int length = ts->valuesize->generate();
+
+  if (routed && !ts->ring) {
+    for (auto &s : servers) issue_set(&s, key, &ts->values[index], length);
+  } else {
+    issue_set(route(key), key, &ts->values[index], length);
+  }
+}
+
+/**
+ * Return the server a key is sent to: its --ketama server, a --replicate
+ * read replica, or else the leader.
+ */
+template <class S>
+server_t* BasicConnection<S>::route(const char* key) {
+  if (!routed) return leader;
+  if (ts->ring) return &servers[ts->ring->lookup(key)];
+
+  // The --read_replica if it is up, else the next one that is.
+  unsigned int first = options.read_replica > 0 ?
+    (options.read_replica - 1) % servers.size() : lrand48() % servers.size();
+  for (unsigned int i = 0; i < servers.size(); i++) {
+    server_t* serv = &servers[(first + i) % servers.size()];
+    if (is_up(serv)) return serv;
+  }
+  return &servers[first];
+}
+
+/**
+ * Requests in flight that count against --depth for serv: its own, or
+ * all of ours when they are routed, plus --cache_aside reads waiting
+ * on the backend.
+ */
+template <class S>
+size_t BasicConnection<S>::outstanding(server_t* serv) {
+  return (routed ? in_flight : serv->op_queue.size()) + backend_waits;
+}
+
+/**
+ * Whether serv may not take another request until one completes.
+ */
+template <class S>
+bool BasicConnection<S>::full(server_t* serv) {
+  return outstanding(serv) >= (size_t) options.depth;
+}
+
 /**
  * Issue either a get or set request to the server according to our probability distribution.
+ * Returns the server it went to, or NULL if the server --ketama or
+ * --replicate picked is down, or too few replicas are up for a write.
  */
-void Connection::issue_something(server_t* serv, double now) {
+template <class S>
+server_t* BasicConnection<S>::issue_something(server_t* serv, double now) {
   char key[256];
   // FIXME: generate key distribution here!
   // Approximate 80-20 rule
@@ -233,100 +431,431 @@ void Connection::issue_something(server_t* serv, double now) {
   int num_20perc_records = options.records * 0.2;
   //string keystr = NULL;
   if (drand48() > 0.8){
-    string keystr = keygen->generate(lrand48() % options.records);
+    string keystr = ts->keygen->generate(lrand48() % options.records);
     strcpy(key, keystr.c_str());
 
   } else { //80% of the time, generate first 20% of keys
-    string keystr = keygen->generate(lrand48() % num_20perc_records);
+    string keystr = ts->keygen->generate(lrand48() % num_20perc_records);
     strcpy(key, keystr.c_str());
   }
 */
   //RANDOM
- string keystr = keygen->generate(lrand48() % options.records);
+ int key_index = lrand48() % options.records;
+ string keystr = ts->keygen->generate(key_index);
  strcpy(key, keystr.c_str());
+
+  bool set = drand48() < options.update;
+  if (set && routed && options.replicate) {
+    int index = lrand48() % (1024 * 1024);
+    return fan_out(key, &ts->values[index], ts->valuesize->generate(), now);
+  }
+
+  serv = route(key);
+  if (!is_up(serv)) {
+    // Down under --reconnect; a real client would fail the request too.
+    stats.errors++;
+    server_stats(serv).errors++;
+    return NULL;
+  }
   
-  if (drand48() < options.update) {
+  if (set) {
     int index = lrand48() % (1024 * 1024);
-    issue_set(serv, key, &random_char[index], valuesize->generate(), now);
+    issue_set(serv, key, &ts->values[index], ts->valuesize->generate(), now);
+  } else if (routed && options.hedge) {
+    hedge_get(serv, key, key_index, now);
+    stats.gets_sent += 1;
+  } else if (options.cache_aside && churn_left < 0) {
+    session_get(serv, key, key_index, now);
+    stats.gets_sent += 1;
   } else {
     issue_get(serv, key, now);
     stats.gets_sent += 1;
   }
+  return serv;
+}
+
+/**
+ * Issue a GET that --hedge may back up with a copy to another replica.
+ * It is a fan-out of one copy that completes on the first answer.
+ */
+template <class S>
+void BasicConnection<S>::hedge_get(server_t* serv, const char* key,
+                                   int key_index, double now) {
+  uint32_t id = fanout_head + fanouts.size();
+  fanout_t f;
+
+  issue_get(serv, key, now, id);
+
+  f.start_time = serv->op_queue.back().start_time();
+  f.copies = 1;
+  f.acks = f.lost = 0;
+  f.needed = 1;
+  f.done = false;
+  f.key = key_index;
+  fanouts.push(f);
+  in_flight++;
+
+  double delay = options.hedge_delay > 0 ?
+    options.hedge_delay / 1000000 : ts->hedge_delay;
+  if (delay > 0.0) {
+    op_ref_t ref = { serv, serv->issued - 1 };
+    if (now == 0.0) now = get_time();
+    ts->hedge_wheel->insert(now + delay, ref);
+  }
+}
+
+/**
+ * Called when the seq'th op issued to serv reaches its --hedge delay.
+ * If it is still unanswered, send the same GET to the next replica
+ * that is up.
+ */
+template <class S>
+void BasicConnection<S>::hedge_op(server_t* serv, uint64_t seq) {
+  uint64_t head = serv->issued - serv->op_queue.size();
+  if (seq < head) return; // Answered in time.
+
+  Operation &op = serv->op_queue[seq - head];
+  fanout_t &f = fanouts[op.fanout - fanout_head];
+  if (f.done || f.copies > 1) return;
+
+  unsigned int i = serv - &servers[0];
+  for (unsigned int n = 1; n < servers.size(); n++) {
+    server_t* backup = &servers[(i + n) % servers.size()];
+    if (!is_up(backup)) continue;
+
+    char key[256];
+    string keystr = ts->keygen->generate(f.key);
+    strcpy(key, keystr.c_str());
+
+    issue_get(backup, key, 0.0, op.fanout);
+    Operation &copy = backup->op_queue.back();
+    copy.hedge = true;
+    copy.set_intended(op.intended_time());
+    f.copies++;
+    stats.hedges++;
+    return;
+  }
+}
+
+/**
+ * Feed a --hedge=pN delay with a completed GET's latency, recomputing
+ * the percentile every HEDGE_WINDOW samples.
+ */
+template <class S>
+void BasicConnection<S>::hedge_sample(double t) {
+  LogHistogramSampler* h = ts->hedge_latency;
+
+  h->sample(t);
+  if (++ts->hedge_samples % HEDGE_WINDOW) return;
+
+  ts->hedge_delay = h->get_nth(options.hedge_nth) / 1000000;
+  // Halve the history so the delay follows changes in load.
+  h->halve();
+}
+
+/**
+ * Issue the GET that starts a --cache_aside read.
+ */
+template <class S>
+void BasicConnection<S>::session_get(server_t* serv, const char* key,
+                                     int key_index, double now) {
+  session_t s;
+
+  issue_get(serv, key, now);
+  Operation &op = serv->op_queue.back();
+  op.session = session_head + sessions.size();
+
+  s.start_time = op.start_time();
+  s.key = key_index;
+  s.miss = s.filling = s.done = false;
+  sessions.push(s);
+}
+
+/**
+ * Account for a completed or lost step of a --cache_aside read.  A GET
+ * that missed goes on to a backend fetch; anything else ends the read,
+ * which counts its latency from the GET through the fill if it worked.
+ */
+template <class S>
+void BasicConnection<S>::session_step(Operation* op, bool ok) {
+  session_t &s = sessions[op->session - session_head];
+
+  if (ok && s.miss && !s.filling) {
+    double delay = max(0.0, ts->backend->generate()) / 1000000;
+    session_ref_t<S> ref = { this, op->session };
+
+    backend_waits++;
+    ts->backend_wheel->insert(op->end_time() + delay, ref);
+    return;
+  }
+
+  if (ok) stats.log_app((op->end_time() - s.start_time) * 1000000);
+  session_end(s);
+}
+
+/**
+ * Mark a --cache_aside read over, and forget those that are over at the
+ * front of sessions.
+ */
+template <class S>
+void BasicConnection<S>::session_end(session_t &s) {
+  s.done = true;
+  while (!sessions.empty() && sessions.front().done) {
+    sessions.pop();
+    session_head++;
+  }
+}
+
+/**
+ * Called when the backend fetch of --cache_aside read id is over: SET
+ * the value it fetched back into the cache.
+ */
+template <class S>
+void BasicConnection<S>::backend_done(uint32_t id) {
+  if (retired || id < session_head) return; // Abandoned by reset().
+
+  session_t &s = sessions[id - session_head];
+  backend_waits--;
+
+  char key[256];
+  string keystr = ts->keygen->generate(s.key);
+  strcpy(key, keystr.c_str());
+
+  server_t* serv = route(key);
+  if (!is_up(serv)) {
+    stats.errors++;
+    server_stats(serv).errors++;
+    session_end(s);
+    drive_write_machine(leader);
+    return;
+  }
+
+  int index = lrand48() % (1024 * 1024);
+  s.filling = true;
+  issue_set(serv, key, &ts->values[index], ts->valuesize->generate());
+  serv->op_queue.back().session = id;
+  stats.fills++;
+}
+
+/**
+ * Send a --replicate write to every server that is up, as one fan-out
+ * that completes once enough of the copies are acknowledged.  Returns
+ * the server of the first copy.
+ */
+template <class S>
+server_t* BasicConnection<S>::fan_out(const char* key, const char* value,
+                                      int length, double now) {
+  fanout_t f;
+  server_t* first = NULL;
+
+  f.copies = f.acks = f.lost = 0;
+  f.done = false;
+  switch (options.replicate) {
+  case REPLICATE_FIRST:  f.needed = 1; break;
+  case REPLICATE_QUORUM: f.needed = servers.size() / 2 + 1; break;
+  default:               f.needed = servers.size(); break;
+  }
+
+  for (auto &s : servers)
+    if (is_up(&s)) f.copies++;
+  if (f.copies < f.needed) {
+    stats.fanout_fails++;
+    return NULL;
+  }
+
+  uint32_t id = fanout_head + fanouts.size();
+  for (auto &s : servers) {
+    if (!is_up(&s)) continue;
+    issue_set(&s, key, value, length, now, id);
+    if (first == NULL) first = &s;
+  }
+
+  f.start_time = first->op_queue.back().start_time();
+  fanouts.push(f);
+  in_flight++;
+  return first;
+}
+
+/**
+ * Account for one copy of a --replicate write, acknowledged or lost.
+ * The fan-out completes on its needed'th ack, fails once too many
+ * copies are lost, and is forgotten when every copy is accounted for.
+ */
+template <class S>
+void BasicConnection<S>::fanout_ack(Operation* op, bool acked) {
+  fanout_t &f = fanouts[op->fanout - fanout_head];
+
+  if (acked) f.acks++;
+  else f.lost++;
+
+  if (!f.done && f.acks >= f.needed) {
+    f.done = true;
+    in_flight--;
+    if (op->type == Operation::SET)
+      stats.log_fanout((op->end_time() - f.start_time) * 1000000);
+  } else if (!f.done && f.copies - f.lost < f.needed) {
+    f.done = true;
+    in_flight--;
+    if (op->type == Operation::SET) stats.fanout_fails++;
+  }
+
+  while (!fanouts.empty() &&
+         fanouts.front().acks + fanouts.front().lost == fanouts.front().copies) {
+    fanouts.pop();
+    fanout_head++;
+  }
+}
+
+/**
+ * Drop the op at the head of a failed server's queue.
+ */
+template <class S>
+void BasicConnection<S>::lose_op(server_t* serv) {
+  Operation &op = serv->op_queue.front();
+
+  if (op.fanout) fanout_ack(&op, false);
+  else in_flight--;
+  if (op.session) session_step(&op, false);
+  serv->op_queue.pop();
+}
+
+/**
+ * Queue an operation as in flight, giving it an --op_timeout deadline
+ * unless it is part of loading or a --churn Connection.
+ */
+template <class S>
+void BasicConnection<S>::push_op(server_t* serv, const Operation& op,
+                                 double now) {
+  serv->op_queue.push(op);
+  if (op.fanout == 0) in_flight++; // fan_out() counts its copies once.
+
+  if (ts->op_wheel && churn_left < 0 && serv->read_state != LOADING) {
+    if (now == 0.0) now = get_time();
+    op_ref_t ref = { serv, serv->issued };
+    ts->op_wheel->insert(now + options.op_timeout / 1000000.0, ref);
+  }
+  serv->issued++;
 }
 
 /**
  * Issue a get request to the server.
  */
-void Connection::issue_get(server_t* serv, const char* key, double now) {
+template <class S>
+void BasicConnection<S>::issue_get(server_t* serv, const char* key, double now,
+                                   uint32_t fanout) {
   Operation op;
   int l;
 
 #if HAVE_CLOCK_GETTIME
-  op.start_time = get_time_accurate();
+  op.set_start(get_time_accurate());
 #else
   if (now == 0.0) {
 #if USE_CACHED_TIME
     struct timeval now_tv;
-    event_base_gettimeofday_cached(base, &now_tv);
-    op.start_time = tv_to_double(&now_tv);
+    event_base_gettimeofday_cached(ts->base, &now_tv);
+    op.set_start(tv_to_double(&now_tv));
 #else
-    op.start_time = get_time();
+    op.set_start(get_time());
 #endif
   } else {
-    op.start_time = now;
+    op.set_start(now);
   }
 #endif
 
   op.type = Operation::GET;
-  serv->op_queue.push(op);
+  op.fanout = fanout;
+  push_op(serv, op, now);
 
-  if (serv->read_state == IDLE) serv->read_state = WAITING_FOR_GET;
+  if (serv->read_state == IDLE) set_read_state(serv, WAITING_FOR_GET);
   l = serv->prot->get_request(key);
+  if (serv->rx_event) serv->op_queue.back().tx_end = serv->tx_added - 1;
   if (serv->read_state != LOADING) stats.tx_bytes += l;
 }
 
 /**
  * Issue a set request to the server.
  */
-void Connection::issue_set(server_t* serv, const char* key, const char* value,
-                           int length, double now) {
+template <class S>
+void BasicConnection<S>::issue_set(server_t* serv, const char* key,
+                                   const char* value, int length, double now,
+                                   uint32_t fanout) {
   Operation op;
   int l;
 
 #if HAVE_CLOCK_GETTIME
-  op.start_time = get_time_accurate();
+  op.set_start(get_time_accurate());
 #else
-  if (now == 0.0) op.start_time = get_time();
-  else op.start_time = now;
+  if (now == 0.0) op.set_start(get_time());
+  else op.set_start(now);
 #endif
 
   op.type = Operation::SET;
-  serv->op_queue.push(op);
+  op.fanout = fanout;
+  push_op(serv, op, now);
 
-  if (serv->read_state == IDLE) serv->read_state = WAITING_FOR_SET;
+  if (serv->read_state == IDLE) set_read_state(serv, WAITING_FOR_SET);
   l = serv->prot->set_request(key, value, length);
+  if (serv->rx_event) serv->op_queue.back().tx_end = serv->tx_added - 1;
   if (serv->read_state != LOADING) stats.tx_bytes += l;
 }
 
+/**
+ * Issue the next request of a --churn Connection once all its servers
+ * are IDLE, or retire it after the last one so churn_reap() closes it.
+ */
+template <class S>
+void BasicConnection<S>::churn_next() {
+  if (retired) return;
+  for (auto &s : servers)
+    if (s.read_state != IDLE) return;
+
+  if (churn_left == 0) {
+    stats.churns++;
+    retired = true;
+    ts->churn_done.push_back(this);
+    return;
+  }
+
+  churn_left--;
+  issue_something(leader);
+}
+
+/**
+ * Move a server's read state machine, keeping the thread's counts of
+ * non-IDLE and of down servers current so readiness checks are O(1).
+ */
+template <class S>
+void BasicConnection<S>::set_read_state(server_t* serv, read_state_enum state) {
+  if (serv->read_state == IDLE && state != IDLE) ts->busy++;
+  else if (serv->read_state != IDLE && state == IDLE) ts->busy--;
+  bool was_up = is_up(serv);
+  serv->read_state = state;
+  if (was_up && !is_up(serv)) ts->down++;
+  else if (!was_up && is_up(serv)) ts->down--;
+}
+
 /**
  * Return the oldest live operation in progress.
  */
-void Connection::pop_op(server_t* serv) {
+template <class S>
+void BasicConnection<S>::pop_op(server_t* serv) {
   assert(serv->op_queue.size() > 0);
 
+  if (serv->op_queue.front().fanout == 0) in_flight--;
   serv->op_queue.pop();
 
   if (serv->read_state == LOADING) return;
-  serv->read_state = IDLE;
 
   // Advance the read state machine.
   if (serv->op_queue.size() > 0) {
     Operation& op = serv->op_queue.front();
     switch (op.type) {
-    case Operation::GET: serv->read_state = WAITING_FOR_GET; break;
-    case Operation::SET: serv->read_state = WAITING_FOR_SET; break;
+    case Operation::GET: set_read_state(serv, WAITING_FOR_GET); break;
+    case Operation::SET: set_read_state(serv, WAITING_FOR_SET); break;
     default: DIE("Not implemented.");
     }
+  } else {
+    set_read_state(serv, IDLE);
   }
 }
 
@@ -334,28 +863,83 @@ void Connection::pop_op(server_t* serv) {
  * Finish up (record stats) an operation that just returned from the
  * server.
  */
-void Connection::finish_op(server_t* serv, Operation *op) {
+template <class S>
+void BasicConnection<S>::finish_op(server_t* serv, Operation *op) {
   double now;
 #if USE_CACHED_TIME
   struct timeval now_tv;
-  event_base_gettimeofday_cached(base, &now_tv);
+  event_base_gettimeofday_cached(ts->base, &now_tv);
   now = tv_to_double(&now_tv);
 #else
   now = get_time();
 #endif
 #if HAVE_CLOCK_GETTIME
-  op->end_time = get_time_accurate();
+  op->set_end(get_time_accurate());
 #else
-  op->end_time = now;
+  op->set_end(now);
 #endif
 
-  stats.rx_bytes = serv->prot->rx_bytes_stats();
+  if (churn_left >= 0) {
+    if (churn_left == options.churn_requests - 1) stats.log_first(op->time());
+    pop_op(serv);
+    churn_next();
+    return;
+  }
+
+  if (serv->rx_event) log_kernel(serv, op);
+
+  if (op->timed_out) {
+    // Late completion under --timeout_wait.
+    stats.log_timeout(op->time());
+    if (op->fanout) fanout_ack(op, true);
+    if (op->session) session_step(op, false);
+    last_rx = now;
+    pop_op(serv);
+    drive_write_machine(leader);
+    return;
+  }
+
+  if (serv->down_since > 0.0) {
+    // First response since a --reconnect: the server is back.
+    server_stats_t &ss = server_stats(serv);
+    double outage = serv->up_since - serv->down_since;
+    double recovery = now - serv->up_since;
+
+    ss.outages++;
+    ss.outage_sum += outage;
+    ss.outage_max = max(ss.outage_max, outage);
+    ss.recovery_sum += recovery;
+    ss.recovery_max = max(ss.recovery_max, recovery);
+    serv->down_since = serv->up_since = 0.0;
+    serv->backoff = 0.0;
+  }
+
+  if (op->fanout && op->type == Operation::GET) {
+    // --hedge: the first answer completes the GET, from when the first
+    // copy went out.  Late duplicates are drained.
+    fanout_t &f = fanouts[op->fanout - fanout_head];
+    if (f.done) {
+      stats.hedge_late++;
+      fanout_ack(op, true);
+      last_rx = now;
+      pop_op(serv);
+      drive_write_machine(leader);
+      return;
+    }
+    if (op->hedge) stats.hedge_wins++;
+    op->set_start(f.start_time);
+    if (options.hedge_nth > 0) hedge_sample(op->time());
+  }
+
+  stats.log_intended(*op);
+  if (ts->interval && stats.sampling)
+    ts->interval->live().latency.sample(op->time());
+  if (ts->ring && routed) stats.log_server(serv - &servers[0], op->time());
 
   switch (op->type) {
   case Operation::GET:
     if (op->switched > 0) op->type = Operation::GETW;
     stats.log_get(*op);
-    stats.get_misses = serv->prot->get_misses_stats();
     break;
   case Operation::SET:
     if (op->switched > 0) op->type = Operation::SETW;
@@ -364,6 +948,8 @@ void Connection::finish_op(server_t* serv, Operation *op) {
   default: DIE("Not implemented.");
   }
 
+  if (op->fanout) fanout_ack(op, true);
+  if (op->session) session_step(op, true);
   last_rx = now;
   pop_op(serv);
   drive_write_machine(leader);
@@ -372,7 +958,8 @@ void Connection::finish_op(server_t* serv, Operation *op) {
 /**
  * Check if our testing is done and we should exit.
  */
-bool Connection::check_exit_condition(double now) {
+template <class S>
+bool BasicConnection<S>::check_exit_condition(double now) {
   bool connected = true;
   bool idle = true;
 
@@ -383,39 +970,298 @@ bool Connection::check_exit_condition(double now) {
 
   if (!connected) return false;
   if (now == 0.0) now = get_time();
-  if (now > start_time + options.time) return true;
+  if (now > ts->start_time + options.time) return true;
   if (options.loadonly && idle) return true;
   return false;
 }
 
+/**
+ * Return the --reconnect statistics for a server.
+ */
+template <class S>
+server_stats_t& BasicConnection<S>::server_stats(server_t* serv) {
+  return stats.server_stats[serv->name];
+}
+
+/**
+ * Tear down a server's connection after an error under --reconnect.
+ * Requests in flight on it count as errors.  A --churn Connection
+ * retires; any other schedules a reconnect with exponential backoff.
+ */
+template <class S>
+void BasicConnection<S>::fail_server(server_t* serv) {
+  server_stats_t &ss = server_stats(serv);
+  struct timeval tv;
+
+  if (serv->read_state == LOADING)
+    DIE("Lost %s:%s while loading.", serv->host.c_str(), serv->port.c_str());
+
+  if (serv->read_state == INIT_READ) {
+    ts->connecting--;
+    connect_pending(ts);
+  }
+
+  stats.errors += serv->op_queue.size();
+  ss.errors += serv->op_queue.size();
+  while (!serv->op_queue.empty()) lose_op(serv);
+
+  if (serv->rx_event) event_free(serv->rx_event);
+  bufferevent_free(serv->bev);
+  delete serv->prot;
+  serv->rx_event = NULL;
+  serv->bev  = NULL;
+  serv->prot = NULL;
+  set_read_state(serv, INIT_READ);
+
+  if (serv->down_since == 0.0) {
+    serv->down_since = get_time();
+    ss.failures++;
+  }
+  serv->up_since = 0.0;
+
+  if (churn_left >= 0) {
+    retired = true;
+    ts->churn_done.push_back(this);
+    return;
+  }
+
+  if (serv->backoff == 0.0) serv->backoff = options.backoff_min;
+  else serv->backoff = min(serv->backoff * 2, options.backoff_max);
+
+  if (serv->reconnect_timer == NULL)
+    serv->reconnect_timer = evtimer_new(ts->base, reconnect_cb<S>, serv);
+  double_to_tv(serv->backoff, &tv);
+  evtimer_add(serv->reconnect_timer, &tv);
+
+  // Let an open-loop leader account for the requests it can't send.
+  if (leader->write_state != INIT_WRITE) drive_write_machine(leader);
+}
+
+/**
+ * Mark a server ready once its connection is set up.  After a
+ * --reconnect this resumes the write machine if the run has started.
+ */
+template <class S>
+void BasicConnection<S>::setup_done(server_t* serv) {
+  set_read_state(serv, IDLE);
+
+  if (churn_left >= 0) {
+    churn_next();
+  } else if (serv->down_since > 0.0) {
+    serv->up_since = get_time();
+    if (leader->write_state != INIT_WRITE) drive_write_machine(leader);
+  }
+}
+
+#ifdef HAVE_LINUX_NET_TSTAMP_H
+static double ts_to_double(const struct timespec *ts) {
+  return ts->tv_sec + (double) ts->tv_nsec / 1000000000;
+}
+
+/**
+ * Ask for software TX and RX timestamps on a server's socket.  Reading
+ * moves from the bufferevent to rx_event, since read() can't return the
+ * RX timestamps.
+ */
+template <class S>
+void BasicConnection<S>::enable_timestamping(server_t* serv, int fd) {
+  int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE |
+    SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+    SOF_TIMESTAMPING_OPT_TSONLY;
+
+  if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING,
+                 (void *) &flags, sizeof(flags)) < 0)
+    DIE("setsockopt(SO_TIMESTAMPING): %s", strerror(errno));
+
+  // OPT_ID numbers TX timestamps by byte offset from here.
+  serv->tx_added = 0;
+  serv->rx_added = 0;
+  while (!serv->tx_stamps.empty()) serv->tx_stamps.pop();
+  while (!serv->rx_stamps.empty()) serv->rx_stamps.pop();
+
+  serv->rx_event = event_new(ts->base, fd, EV_READ | EV_PERSIST, rx_cb<S>,
+                             serv);
+  event_add(serv->rx_event, NULL);
+}
+
+/**
+ * Collect TX timestamps from the error queue, then read responses into
+ * the bufferevent's input along with the time the kernel received them.
+ */
+template <class S>
+void BasicConnection<S>::timestamp_read(server_t* serv) {
+  int fd = event_get_fd(serv->rx_event);
+  struct evbuffer *input = bufferevent_get_input(serv->bev);
+  char data[16384];
+  char control[512];
+  struct iovec iov;
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+
+  while (1) {
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) break;
+
+    struct scm_timestamping *tss = NULL;
+    struct sock_extended_err *err = NULL;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET &&
+          cmsg->cmsg_type == SCM_TIMESTAMPING)
+        tss = (struct scm_timestamping *) CMSG_DATA(cmsg);
+      else if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+               (cmsg->cmsg_level == SOL_IPV6 &&
+                cmsg->cmsg_type == IPV6_RECVERR))
+        err = (struct sock_extended_err *) CMSG_DATA(cmsg);
+    }
+
+    if (tss && tss->ts[0].tv_sec && err &&
+        err->ee_origin == SO_EE_ORIGIN_TIMESTAMPING &&
+        err->ee_info == SCM_TSTAMP_SND) {
+      stamp_t s = { err->ee_data, ts_to_double(&tss->ts[0]) };
+      serv->tx_stamps.push(s);
+    }
+  }
+
+  short error = 0;
+  while (1) {
+    iov.iov_base = data;
+    iov.iov_len = sizeof(data);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (n == 0) {
+      error = BEV_EVENT_EOF;
+      break;
+    } else if (n < 0) {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) error = BEV_EVENT_ERROR;
+      break;
+    }
+
+    evbuffer_add(input, data, n);
+    serv->rx_added += n;
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET &&
+          cmsg->cmsg_type == SCM_TIMESTAMPING) {
+        struct scm_timestamping *tss =
+          (struct scm_timestamping *) CMSG_DATA(cmsg);
+        if (!tss->ts[0].tv_sec) continue;
+        stamp_t s = { serv->rx_added, ts_to_double(&tss->ts[0]) };
+        serv->rx_stamps.push(s);
+      }
+    }
+
+    if ((size_t) n < sizeof(data)) break;
+  }
+
+  if (evbuffer_get_length(input) > 0) read_callback(serv);
+  if (error && serv->rx_event) event_callback(serv, BEV_EVENT_READING | error);
+}
+
+/**
+ * Record an op's kernel-to-kernel latency, from the kernel sending the
+ * last byte of the request to it receiving the last byte of the
+ * response, and what the rest of its latency was spent on.
+ */
+template <class S>
+void BasicConnection<S>::log_kernel(server_t* serv, Operation* op) {
+  RingBuffer<stamp_t> &tx = serv->tx_stamps, &rx = serv->rx_stamps;
+  uint64_t end =
+    serv->rx_added - evbuffer_get_length(bufferevent_get_input(serv->bev));
+
+  // One write, or one read, may cover several ops.
+  while (!tx.empty() && (int32_t) ((uint32_t) tx.front().end - op->tx_end) < 0)
+    tx.pop();
+  while (!rx.empty() && rx.front().end < end) rx.pop();
+  if (tx.empty() || rx.empty()) return; // Not reported (yet).
+
+  // The stamps are CLOCK_REALTIME, op times CLOCK_MONOTONIC_RAW: a clock
+  // step, or stamps matched to the wrong bytes, can put them out of order.
+  double kernel = (rx.front().time - tx.front().time) * 1000000;
+  if (kernel <= 0 || kernel > op->time()) {
+    stats.kernel_skips++;
+    return;
+  }
+  stats.log_kernel(kernel, op->time() - kernel);
+}
+#else
+template <class S>
+void BasicConnection<S>::enable_timestamping(server_t* serv, int fd) {
+  DIE("--timestamping support not compiled in");
+}
+template <class S>
+void BasicConnection<S>::timestamp_read(server_t* serv) {}
+template <class S>
+void BasicConnection<S>::log_kernel(server_t* serv, Operation* op) {}
+#endif
+
 /**
  * Handle new connection and error events.
  */
-void Connection::event_callback(server_t* serv, short events) {
+template <class S>
+void BasicConnection<S>::event_callback(server_t* serv, short events) {
+  if (retired) return;
+
   if (events & BEV_EVENT_CONNECTED) {
     D("Connected to %s:%s.\n", serv->host.c_str(), serv->port.c_str());
+    serv->setup_start = get_time();
+    stats.log_connect((serv->setup_start - serv->connect_start) * 1000000);
+
+    if (!ts->uring) bufferevent_set_timeouts(serv->bev, NULL, NULL);
+    ts->connecting--;
+    connect_pending(ts);
+
     int fd = bufferevent_getfd(serv->bev);
     if (fd < 0) DIE("bufferevent_getfd\n");
 
-    if (!options.no_nodelay) {
+    if (!options.no_nodelay && !serv->unix_socket) {
       int one = 1;
       if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
                      (void *) &one, sizeof(one)) < 0)
         DIE("setsockopt()\n");
     }
 
-    serv->read_state = CONN_SETUP;
-    if (serv->prot->setup_connection_w()) {
-      serv->read_state = IDLE;
+#ifdef SO_BUSY_POLL
+    if (options.busy_poll > 0 && !serv->unix_socket) {
+      int usecs = options.busy_poll;
+      if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL,
+                     (void *) &usecs, sizeof(usecs)) < 0)
+        W("setsockopt(SO_BUSY_POLL): %s", strerror(errno));
     }
+#endif
+
+    if (options.timestamping && !serv->unix_socket)
+      enable_timestamping(serv, fd);
+
+    set_read_state(serv, CONN_SETUP);
+    if (serv->prot->setup_connection_w()) setup_done(serv);
 
   } else if (events & BEV_EVENT_ERROR) {
     int err = bufferevent_socket_get_dns_error(serv->bev);
     if (err) DIE("DNS error: %s\n", evutil_gai_strerror(err));
-    DIE("BEV_EVENT_ERROR: %s => %s\n", serv->host.c_str(), strerror(errno));
+    if (!options.reconnect)
+      DIE("BEV_EVENT_ERROR: %s => %s\n", serv->host.c_str(), strerror(errno));
+    V("BEV_EVENT_ERROR: %s => %s", serv->host.c_str(), strerror(errno));
+    fail_server(serv);
 
   } else if (events & BEV_EVENT_EOF) {
-    DIE("Unexpected EOF from server.\n");
+    if (!options.reconnect) DIE("Unexpected EOF from server.\n");
+    V("Unexpected EOF from %s:%s.", serv->host.c_str(), serv->port.c_str());
+    fail_server(serv);
+
+  } else if (events & BEV_EVENT_TIMEOUT) {
+    if (!options.reconnect)
+      DIE("Timed out connecting to %s:%s after %.1fs.\n", serv->host.c_str(),
+          serv->port.c_str(), options.connect_timeout);
+    V("Timed out connecting to %s:%s.", serv->host.c_str(), serv->port.c_str());
+    fail_server(serv);
   }
 }
 
@@ -425,72 +1271,110 @@ void Connection::event_callback(server_t* serv, short events) {
  *
  * Note that this function loops. Be wary of break vs. return.
  */
-void Connection::drive_write_machine(server_t* serv, double now) {
-  if (now == 0.0) now = get_time();
+template <class S>
+void BasicConnection<S>::drive_write_machine(server_t* serv, double now) {
+  server_t* target;
 
-  double delay;
-  struct timeval tv;
+  if (now == 0.0) now = get_time();
 
   if (check_exit_condition(now)) return;
+  if (migrate_to && try_migrate(now)) return;
 
   while (1) {
     switch (serv->write_state) {
     case INIT_WRITE:
-      delay = iagen->generate();
-      next_time = now + delay;
-      double_to_tv(delay, &tv);
-      evtimer_add(timer, &tv);
+      next_time = now + ts->iagen->generate();
+      schedule(next_time);
       serv->write_state = WAITING_FOR_TIME;
       break;
 
     case ISSUING:
-      if (serv->op_queue.size() >= (size_t) options.depth) {
-        serv->write_state = WAITING_FOR_OPQ;
-        return;
+      if (!routed && !is_up(serv)) {
+        // Down under --reconnect.  Open-loop requests that fall due are
+        // lost; closed-loop ones wait for setup_done() to resume.
+        if (options.lambda <= 0.0) {
+          serv->write_state = WAITING_FOR_TIME;
+          return;
+        }
+        while (next_time <= now) {
+          stats.errors++;
+          server_stats(serv).errors++;
+          next_time += ts->iagen->generate();
+        }
+        serv->write_state = WAITING_FOR_TIME;
+        break;
+      } else if (backlog_ready(serv)) {
+        // Oldest --open_loop arrival first.
+        target = issue_something(serv, now);
+        if (target) set_intended(target, backlog.front(), now);
+        stats.log_queued((now - backlog.front()) * 1000000);
+        backlog.pop();
+        last_tx = now;
+        stats.log_op(outstanding(serv));
+        break;
+      } else if (full(serv)) {
+        if (!options.open_loop) {
+          serv->write_state = WAITING_FOR_OPQ;
+          return;
+        }
+        // Arrivals keep coming on schedule while the pipeline is full.
+        if (now >= next_time) {
+          overflow(next_time, now);
+          next_time += ts->iagen->generate();
+        } else {
+          serv->write_state = WAITING_FOR_TIME;
+        }
+        break;
       } else if (now < next_time) {
         serv->write_state = WAITING_FOR_TIME;
         break; // We want to run through the state machine one more time
                // to make sure the timer is armed.
       } else if (options.moderate && now < last_rx + 0.00025) { //ANA try decreasing this number?
         serv->write_state = WAITING_FOR_TIME;
-        if (!event_pending(timer, EV_TIMEOUT, NULL)) {
-          delay = last_rx + 0.00025 - now;
-          double_to_tv(delay, &tv);
-          evtimer_add(timer, &tv);
-        }
+        if (sched_due == 0.0) schedule(last_rx + 0.00025);
         return;
       }
 
-      issue_something(serv, now);
+      target = issue_something(serv, now);
+      if (target == NULL && options.lambda <= 0.0) {
+        // --ketama or --replicate found its server down.  Wait for a
+        // response or a setup_done() rather than spin on errors.
+        serv->write_state = WAITING_FOR_TIME;
+        return;
+      }
+      if (options.lambda > 0.0) {
+        if (target) set_intended(target, next_time, now);
+        // Achieved vs. intended gap since the previous scheduled send.
+        if (last_intended > 0.0)
+          stats.log_pacing(fabs((now - last_tx) -
+                                (next_time - last_intended)) * 1000000);
+        last_intended = next_time;
+      }
+      if (options.open_loop) stats.log_backlog(0);
       last_tx = now;
-      stats.log_op(serv->op_queue.size());
-      next_time += iagen->generate();
+      stats.log_op(outstanding(serv));
+      next_time += ts->iagen->generate();
 
       if (options.skip && options.lambda > 0.0 &&
-          now - next_time > 0.005000 &&
-          serv->op_queue.size() >= (size_t) options.depth) {
+          now - next_time > 0.005000 && full(serv)) {
 
         while (next_time < now - 0.004000) {
           stats.skips++;
-          next_time += iagen->generate();
+          next_time += ts->iagen->generate();
         }
       }
       break;
 
     case WAITING_FOR_TIME:
-      if (now < next_time) {
-        if (!event_pending(timer, EV_TIMEOUT, NULL)) {
-          delay = next_time - now;
-          double_to_tv(delay, &tv);
-          evtimer_add(timer, &tv);
-        }
+      if (now < next_time && !backlog_ready(serv)) {
+        if (sched_due == 0.0) schedule(next_time);
         return;
       }
       serv->write_state = ISSUING;
       break;
 
     case WAITING_FOR_OPQ:
-      if (serv->op_queue.size() >= (size_t) options.depth) return;
+      if (full(serv)) return;
       serv->write_state = ISSUING;
       break;
 
@@ -499,19 +1383,219 @@ void Connection::drive_write_machine(server_t* serv, double now) {
   }
 }
 
+// --rebalance: the threads that can take Connections, and the lock
+// that guards it along with every thread's load and mailbox.
+template <class S> static vector<thread_state_t<S>*>& rebalance_threads() {
+  static vector<thread_state_t<S>*> threads;
+  return threads;
+}
+static pthread_mutex_t rebalance_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Work towards a --rebalance move: hold off new requests until nothing
+ * is in flight or buffered, then migrate().  Returns false to carry on
+ * here instead, as when a server is down.
+ */
+template <class S>
+bool BasicConnection<S>::try_migrate(double now) {
+  for (auto &s : servers) {
+    if (!is_up(&s)) {
+      migrate_to = NULL;
+      return false;
+    }
+  }
+
+  for (auto &s : servers) {
+    if (s.read_state != IDLE || s.corked || backend_waits > 0 ||
+        evbuffer_get_length(bufferevent_get_input(s.bev)) ||
+        evbuffer_get_length(bufferevent_get_output(s.bev))) {
+      // Draining; responses drive us again, but a stuck write wouldn't.
+      if (sched_due == 0.0) schedule(now + 0.0001);
+      return true;
+    }
+  }
+
+  return migrate();
+}
+
+/**
+ * Copy ourselves into migrate_to's mailbox, handing the copy our
+ * sockets.  What is left here stays idle until the thread exits, since
+ * its timing wheels may still point at us.  Returns false if migrate_to
+ * has already left.
+ */
+template <class S>
+bool BasicConnection<S>::migrate() {
+  thread_state_t<S>* to = migrate_to;
+  vector<thread_state_t<S>*> &threads = rebalance_threads<S>();
+  vector<evutil_socket_t> fds;
+
+  migrate_to = NULL;
+
+  pthread_mutex_lock(&rebalance_lock);
+  if (find(threads.begin(), threads.end(), to) == threads.end()) {
+    pthread_mutex_unlock(&rebalance_lock);
+    return false;
+  }
+
+  for (auto &s : servers) {
+    fds.push_back(bufferevent_getfd(s.bev));
+    bufferevent_setfd(s.bev, -1); // Keeps the socket open across free.
+    bufferevent_free(s.bev);
+    delete s.prot;
+    s.bev  = NULL;
+    s.prot = NULL;
+  }
+
+  to->mailbox.push_back(new BasicConnection<S>(to, *this, fds));
+  if (write(to->mailbox_fd[1], "", 1) < 0 && errno != EAGAIN)
+    DIE("write(mailbox): %s", strerror(errno));
+  pthread_mutex_unlock(&rebalance_lock);
+
+  retired = true;
+  sched_due = 0.0;
+  while (!backlog.empty()) backlog.pop();
+  ts->conns.erase(find(ts->conns.begin(), ts->conns.end(), this));
+  ts->moved.push_back(this);
+  stats.migrations++;
+  return true;
+}
+
+/**
+ * Take over the sockets of a Connection moved to this thread, and carry
+ * on where it left off.
+ */
+template <class S>
+void BasicConnection<S>::adopt() {
+  for (size_t i = 0; i < servers.size(); i++)
+    attach(servers[i], adopted[i]);
+  adopted.clear();
+
+  ts->conns.push_back(this);
+  if (leader->write_state != INIT_WRITE) drive_write_machine(leader);
+}
+
+/**
+ * NUMA node of the CPU that last received packets on the leader's
+ * socket, or -1 if unknown.
+ */
+template <class S>
+int BasicConnection<S>::incoming_node() {
+#ifdef SO_INCOMING_CPU
+  int cpu;
+  socklen_t len = sizeof(cpu);
+  evutil_socket_t fd = leader->bev ? bufferevent_getfd(leader->bev) : -1;
+
+  if (leader->unix_socket || fd < 0 ||
+      getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) || cpu < 0)
+    return -1;
+  return cpu_node(cpu);
+#else
+  return -1;
+#endif
+}
+
+/**
+ * Stamp the op just issued to serv with the time the arrival process
+ * intended to send it.  intended is on get_time()'s clock, start_time
+ * may not be, so go by how late it is now.
+ */
+template <class S>
+void BasicConnection<S>::set_intended(server_t* serv, double intended,
+                                      double now) {
+  Operation &op = serv->op_queue.back();
+  op.set_intended(op.start_time() - (now - intended));
+  if (op.fanout == 0) return;
+
+  // The other copies of a --replicate write.
+  for (auto &s : servers) {
+    if (&s == serv || s.op_queue.empty()) continue;
+    Operation &copy = s.op_queue.back();
+    if (copy.fanout == op.fanout)
+      copy.set_intended(copy.start_time() - (now - intended));
+  }
+}
+
+/**
+ * Have the thread's send scheduler drive us at when, replacing any
+ * earlier request.
+ */
+template <class S>
+void BasicConnection<S>::schedule(double when) {
+  sched_ref_t<S> ref = { this, when };
+  sched_due = when;
+  ts->sched->insert(when, ref);
+}
+
+/**
+ * Whether serv has room for an --open_loop arrival waiting in the backlog.
+ */
+template <class S>
+bool BasicConnection<S>::backlog_ready(server_t* serv) {
+  return !backlog.empty() && !full(serv);
+}
+
+/**
+ * An --open_loop arrival due at intended found the pipeline full.  Drop
+ * it, spill it onto another of the thread's Connections with room, or
+ * hold it in the backlog until a response frees a slot.
+ */
+template <class S>
+void BasicConnection<S>::overflow(double intended, double now) {
+  if (options.open_loop == OPEN_LOOP_DROP) {
+    stats.drops++;
+    return;
+  }
+
+  if (options.open_loop == OPEN_LOOP_SPILL && ts->conns.size() > 1) {
+    // Two random choices: cheap, and enough to find slack if there is any.
+    for (int i = 0; i < 2; i++) {
+      BasicConnection<S>* conn = ts->conns[lrand48() % ts->conns.size()];
+      if (conn != this && conn->spill(intended, now)) {
+        stats.spills++;
+        return;
+      }
+    }
+  }
+
+  backlog.push(intended);
+  stats.log_backlog(backlog.size());
+}
+
+/**
+ * Take an arrival spilled from another Connection if our leader has
+ * room for it right away.  Not while draining for a --rebalance move:
+ * the op would outlive the drain and land on the new thread unseen.
+ */
+template <class S>
+bool BasicConnection<S>::spill(double intended, double now) {
+  if (moving()) return false;
+  if (leader->write_state == INIT_WRITE || leader->read_state == INIT_READ ||
+      leader->read_state == CONN_SETUP || leader->read_state == LOADING ||
+      !backlog.empty() || full(leader))
+    return false;
+
+  server_t* target = issue_something(leader, now);
+  if (target) set_intended(target, intended, now);
+  stats.log_op(outstanding(leader));
+  return true;
+}
+
 /**
  * Handle incoming data (responses).
  */
-void Connection::read_callback(server_t* serv) {
+template <class S>
+void BasicConnection<S>::read_callback(server_t* serv) {
   struct evbuffer *input = bufferevent_get_input(serv->bev);
   Operation *op = NULL;
 
-  if (serv->op_queue.size() == 0) V("Spurious read callback.");
+  if (serv->op_queue.size() == 0 && serv->read_state != CONN_SETUP)
+    V("Spurious read callback.");
 
   while (1) {
     if (serv->op_queue.size() > 0) {
       op = &serv->op_queue.front();
-    } else {
+    } else if (serv->read_state != CONN_SETUP) {
       // since we're in a loop, may need to escape if out of op's to process
       return;
     }
@@ -521,42 +1605,51 @@ void Connection::read_callback(server_t* serv) {
     case IDLE: return;  // We munched all the data we expected?
 
     case WAITING_FOR_GET:
-    case WAITING_FOR_SET:
+    case WAITING_FOR_SET: {
+      uint64_t misses = stats.get_misses;
+
       assert(serv->op_queue.size() > 0);
       if (!serv->prot->handle_response(input, op)) return;
+      if (op->session && stats.get_misses != misses)
+        sessions[op->session - session_head].miss = true;
       finish_op(serv, op); // sets read_state = IDLE
       break;
+    }
+
+    case LOADING: {
+      // Under --replicate or --hedge every key is loaded onto each server.
+      int copies = routed && !ts->ring ? servers.size() : 1;
 
-    case LOADING:
       assert(serv->op_queue.size() > 0);
       if (!serv->prot->handle_response(input, op)) return;
       loader_completed++;
       pop_op(serv);
 
-      if (loader_completed == options.records) {
+      if (loader_completed == options.records * copies) {
         D("Finished loading.");
         for (auto &s : servers) {
-          s.read_state = IDLE;
+          set_read_state(&s, IDLE);
         }
       } else {
-        while (loader_issued < loader_completed + LOADER_CHUNK) {
+        while (loader_issued < loader_completed / copies + LOADER_CHUNK) {
           if (loader_issued >= options.records) break;
 
           char key[256];
-          string keystr = keygen->generate(loader_issued);
+          string keystr = ts->keygen->generate(loader_issued);
           strcpy(key, keystr.c_str());
-          int index = lrand48() % (1024 * 1024);
-          issue_set(leader, key, &random_char[index], valuesize->generate());
+          load_key(key);
 
           loader_issued++;
         }
       }
       break;
+    }
 
     case CONN_SETUP:
       assert(options.binary);
       if (!serv->prot->setup_connection_r(input)) return;
-      serv->read_state = IDLE;
+      stats.log_sasl((get_time() - serv->setup_start) * 1000000);
+      setup_done(serv);
       break;
 
     default: DIE("not implemented");
@@ -567,7 +1660,8 @@ void Connection::read_callback(server_t* serv) {
 /**
  * Prints out the state of the connection in regards to loading data.
  */
-void Connection::print_load_state() {
+template <class S>
+void BasicConnection<S>::print_load_state() {
   printf("Loads Required: %d, Complete: %d, Issued: %d\n",
     options.records, loader_completed, loader_issued);
   for (auto &s : servers) {
@@ -578,34 +1672,519 @@ void Connection::print_load_state() {
 /**
  * Callback called when write requests finish.
  */
-void Connection::write_callback() {}
+template <class S>
+void BasicConnection<S>::write_callback(server_t* serv) {
+  if (options.cork && !ts->uring) bufferevent_disable(serv->bev, EV_WRITE);
+}
 
 /**
- * Callback for timer timeouts.
+ * Callback for changes to a server's output buffer.  Counts the writes
+ * that drain it and, under --cork, queues the server for flush_corked().
  */
-void Connection::timer_callback() {
-  drive_write_machine(leader);
+template <class S>
+void BasicConnection<S>::output_callback(server_t* serv,
+                                         const struct evbuffer_cb_info *info) {
+  if (info->n_deleted > 0 && serv->read_state != LOADING) stats.tx_writes++;
+  if (serv->rx_event) serv->tx_added += info->n_added;
+
+  if (info->n_added > 0 && options.cork && !ts->uring && !serv->corked) {
+    serv->corked = true;
+    ts->corked.push_back(serv);
+  }
 }
 
+/**
+ * Called by the send scheduler once due has passed.
+ */
+template <class S>
+void BasicConnection<S>::sched_callback(double due) {
+  if (due != sched_due) return; // Rescheduled or reset since.
+  sched_due = 0.0;
+
+  double now = get_time();
+  stats.log_dispatch((now - due) * 1000000);
+  drive_write_machine(leader, now);
+}
+
+/**
+ * Called when the seq'th op issued to serv reaches its --op_timeout
+ * deadline.  If it is still in flight it counts as a timeout and, unless
+ * --timeout_wait, the server's connection is dropped and reconnected.
+ */
+template <class S>
+void BasicConnection<S>::timeout_op(server_t* serv, uint64_t seq) {
+  uint64_t head = serv->issued - serv->op_queue.size();
+  if (seq < head) return; // Completed in time.
+
+  Operation& op = serv->op_queue[seq - head];
+  stats.timeouts++;
+
+  if (options.timeout_wait) {
+    op.timed_out = true;
+    return;
+  }
+
+  // Deadlines are FIFO, so the op at the head is always the first due.
+  assert(seq == head);
+#if HAVE_CLOCK_GETTIME
+  op.set_end(get_time_accurate());
+#else
+  op.set_end(get_time());
+#endif
+  stats.log_timeout(op.time());
+  lose_op(serv);
+
+  V("Request to %s:%s timed out, dropping connection.", serv->host.c_str(),
+    serv->port.c_str());
+  fail_server(serv);
+}
+
+/**
+ * Callback for a server's --reconnect backoff timer.
+ */
+template <class S>
+void BasicConnection<S>::reconnect_callback(server_t* serv) {
+  D("Reconnecting to %s:%s.", serv->host.c_str(), serv->port.c_str());
+  connect_server(*serv);
+}
+
+
+/**
+ * Write out everything --cork held back during the last event loop
+ * pass, one writev() per server.  Anything a short write leaves behind
+ * is handed to the bufferevent to drain.
+ */
+template <class S>
+void flush_corked(thread_state_t<S>* ts) {
+  for (server_t* serv: ts->corked) {
+    serv->corked = false;
+    if (serv->bev == NULL) continue; // Failed since it was corked.
+
+    struct evbuffer *output = bufferevent_get_output(serv->bev);
+    evbuffer_write(output, bufferevent_getfd(serv->bev));
+    if (evbuffer_get_length(output) > 0)
+      bufferevent_enable(serv->bev, EV_WRITE);
+  }
+  ts->corked.clear();
+}
+
+/**
+ * Start queued Connections until --connect_parallel connects are in
+ * flight.  Called again as each connect completes.
+ */
+template <class S>
+void connect_pending(thread_state_t<S>* ts) {
+  int limit = ts->options.connect_parallel;
+
+  while (!ts->connect_queue.empty() &&
+         (limit <= 0 || ts->connecting < limit)) {
+    BasicConnection<S>* conn = ts->connect_queue.front();
+    ts->connect_queue.pop_front();
+    conn->connect();
+  }
+}
+
+/**
+ * Free --churn Connections retired during the last event loop pass.
+ * Called after flush_corked() so none of them has output pending.
+ */
+template <class S>
+void churn_reap(thread_state_t<S>* ts) {
+  for (BasicConnection<S>* conn: ts->churn_done) {
+    ts->churn_active.erase(conn);
+    delete conn;
+  }
+  ts->churn_done.clear();
+}
+
+/**
+ * Expire every --op_timeout deadline that has passed.
+ */
+template <class S>
+void expire_ops(thread_state_t<S>* ts) {
+  ts->op_wheel->advance(get_time(), [](const op_ref_t& ref) {
+      conn_of<S>(ref.serv)->timeout_op(ref.serv, ref.seq);
+    });
+}
+
+/**
+ * Drive every Connection whose scheduled time has passed, and send the
+ * --hedge backups and --cache_aside fills that have come due, in one
+ * pass.
+ */
+template <class S>
+void run_scheduler(thread_state_t<S>* ts) {
+  double now = get_time();
+
+  ts->sched->advance(now, [](const sched_ref_t<S>& ref) {
+      ref.conn->sched_callback(ref.due);
+    });
+  if (ts->hedge_wheel) {
+    ts->hedge_wheel->advance(now, [](const op_ref_t& ref) {
+        conn_of<S>(ref.serv)->hedge_op(ref.serv, ref.seq);
+      });
+  }
+  if (ts->backend_wheel) {
+    ts->backend_wheel->advance(now, [](const session_ref_t<S>& ref) {
+        ref.conn->backend_done(ref.id);
+      });
+  }
+}
+
+/**
+ * Set sched_timer for the scheduler's next deadline.  Called once per
+ * event loop pass, so however many Connections rescheduled during it,
+ * libevent sees at most one timer change.
+ */
+template <class S>
+void arm_scheduler(thread_state_t<S>* ts) {
+  double next = ts->sched->next_expiry();
+  struct timeval tv;
+
+  if (ts->hedge_wheel) {
+    double hedge = ts->hedge_wheel->next_expiry();
+    if (hedge > 0.0 && (next == 0.0 || hedge < next)) next = hedge;
+  }
+  if (ts->backend_wheel) {
+    double backend = ts->backend_wheel->next_expiry();
+    if (backend > 0.0 && (next == 0.0 || backend < next)) next = backend;
+  }
+
+  if (next == 0.0 || next == ts->sched_armed) return;
+
+  double delay = next - get_time();
+  double_to_tv(delay > 0.0 ? delay : 0.0, &tv);
+  evtimer_add(ts->sched_timer, &tv);
+  ts->sched_armed = next;
+}
+
+/**
+ * Set op_timer for the next --op_timeout deadline, or cascade, if it
+ * isn't already; with nothing in flight it stays off.
+ */
+template <class S>
+void arm_op_timer(thread_state_t<S>* ts) {
+  double next = ts->op_wheel->next_expiry();
+  struct timeval tv;
+
+  if (next == 0.0 || next == ts->op_armed) return;
+
+  double delay = next - get_time();
+  double_to_tv(delay > 0.0 ? delay : 0.0, &tv);
+  evtimer_add(ts->op_timer, &tv);
+  ts->op_armed = next;
+}
+
+/**
+ * Make ts a thread other threads can hand Connections to, and under
+ * --rebalance one that measures its load every --rebalance seconds.
+ */
+template <class S>
+void rebalance_join(thread_state_t<S>* ts) {
+  struct timeval tv;
+
+  if (pipe(ts->mailbox_fd)) DIE("pipe(): %s", strerror(errno));
+  evutil_make_socket_nonblocking(ts->mailbox_fd[0]);
+  evutil_make_socket_nonblocking(ts->mailbox_fd[1]);
+  ts->mailbox_event = event_new(ts->base, ts->mailbox_fd[0],
+                                EV_READ | EV_PERSIST, mailbox_cb<S>, ts);
+  event_add(ts->mailbox_event, NULL);
+
+  if (ts->options.rebalance > 0) {
+    ts->rebalance_timer = event_new(ts->base, -1, EV_PERSIST,
+                                    rebalance_cb<S>, ts);
+    double_to_tv(ts->options.rebalance, &tv);
+    evtimer_add(ts->rebalance_timer, &tv);
+  }
+
+  ts->cpu_mark = get_thread_time();
+  ts->idle_mark = ts->idle_time;
+  ts->load_time = get_time();
+  ts->load = 0.0;
+
+  pthread_mutex_lock(&rebalance_lock);
+  rebalance_threads<S>().push_back(ts);
+  pthread_mutex_unlock(&rebalance_lock);
+}
+
+/**
+ * Stop taking Connections from other threads.  Those still in the
+ * mailbox were never started here, so they are simply closed.
+ */
+template <class S>
+void rebalance_leave(thread_state_t<S>* ts) {
+  vector<thread_state_t<S>*> &threads = rebalance_threads<S>();
+  vector<BasicConnection<S>*> mailbox;
+
+  pthread_mutex_lock(&rebalance_lock);
+  threads.erase(find(threads.begin(), threads.end(), ts));
+  mailbox.swap(ts->mailbox);
+  pthread_mutex_unlock(&rebalance_lock);
+
+  for (auto conn : mailbox) delete conn;
+
+  if (ts->rebalance_timer) event_free(ts->rebalance_timer);
+  event_free(ts->mailbox_event);
+  ts->rebalance_timer = ts->mailbox_event = NULL;
+  close(ts->mailbox_fd[0]);
+  close(ts->mailbox_fd[1]);
+}
+
+/**
+ * Work out how busy ts has been since the last tick: the CPU time it
+ * used, less the time it spun through passes that ran no callbacks (a
+ * blocking pass sleeps instead, which costs none).  If it is well ahead
+ * of the least loaded thread, mark enough of its Connections to move
+ * there to even the two out.  They leave once drained.
+ */
+template <class S>
+void rebalance_tick(thread_state_t<S>* ts) {
+  double now = get_time();
+  double cpu = get_thread_time();
+  double busy = (cpu - ts->cpu_mark) - (ts->idle_time - ts->idle_mark);
+  double load = max(busy, 0.0) / (now - ts->load_time);
+  thread_state_t<S>* coolest = NULL;
+
+  ts->cpu_mark = cpu;
+  ts->idle_mark = ts->idle_time;
+  ts->load_time = now;
+  ts->load = load;
+
+  pthread_mutex_lock(&rebalance_lock);
+  for (auto t : rebalance_threads<S>()) {
+    if (t != ts && (coolest == NULL || t->load < coolest->load)) coolest = t;
+  }
+  double cool = coolest ? coolest->load.load() : 0.0;
+  pthread_mutex_unlock(&rebalance_lock);
+
+  if (coolest == NULL || load <= cool * 1.2 + 0.05) return;
+
+  // Moving a share (load - cool) / 2 of our load: conns carry load / n each.
+  int n = ts->conns.size() * (load - cool) / (2 * load);
+  D("rebalance: load %.2f vs %.2f, moving %d connections", load, cool, n);
+
+  for (auto conn : ts->conns) {
+    if (n <= 0) break;
+    if (conn->moving()) continue;
+    conn->move_to(coolest);
+    n--;
+  }
+}
+
+/**
+ * Adopt the Connections other threads have moved to ts.
+ */
+template <class S>
+void rebalance_receive(thread_state_t<S>* ts) {
+  vector<BasicConnection<S>*> mailbox;
+  char buf[64];
+
+  while (read(ts->mailbox_fd[0], buf, sizeof(buf)) > 0) ;
+
+  pthread_mutex_lock(&rebalance_lock);
+  mailbox.swap(ts->mailbox);
+  pthread_mutex_unlock(&rebalance_lock);
+
+  for (auto conn : mailbox) conn->adopt();
+}
+
+/**
+ * --numa_incoming: move each Connection whose packets arrive on another
+ * node's CPU to a thread on that node, round-robin among them.
+ */
+template <class S>
+void rebalance_incoming(thread_state_t<S>* ts) {
+  map<int, vector<thread_state_t<S>*>> nodes;
+  size_t next = 0;
+
+  pthread_mutex_lock(&rebalance_lock);
+  for (auto t : rebalance_threads<S>()) nodes[t->node].push_back(t);
+  pthread_mutex_unlock(&rebalance_lock);
+
+  for (auto conn : ts->conns) {
+    int node = conn->incoming_node();
+    if (node < 0 || node == ts->node || !nodes.count(node)) continue;
+
+    vector<thread_state_t<S>*> &peers = nodes[node];
+    conn->move_to(peers[next++ % peers.size()]);
+  }
+}
+
+/**
+ * Start filling --report intervals of ts->options.report seconds.
+ */
+template <class S>
+void interval_begin(thread_state_t<S>* ts, IntervalBuffer<S>* interval) {
+  struct timeval tv;
+
+  ts->interval = interval;
+  interval->live().start = get_time();
+
+  ts->interval_timer = event_new(ts->base, -1, EV_PERSIST, interval_cb<S>,
+                                 ts);
+  double_to_tv(ts->options.report, &tv);
+  evtimer_add(ts->interval_timer, &tv);
+}
+
+/**
+ * Hand the interval ts has been filling to the reporter and start the
+ * next, or with last, stop.  The next reuses the buffer of the one
+ * before, which the reporter has had a whole interval to take; if it
+ * hasn't, this one runs on to the next tick rather than wait on it.
+ */
+template <class S>
+void interval_flip(thread_state_t<S>* ts, bool last) {
+  IntervalBuffer<S>* b = ts->interval;
+  IntervalStats<S> &s = b->live();
+  uint64_t k = b->current;
+
+  if (!last && b->taken.load(memory_order_acquire) < k) return;
+
+  s.stop = get_time();
+  s.count(ts->stats, b->mark);
+  b->ready.store(k + 1, memory_order_release);
+
+  if (last) {
+    b->done.store(true, memory_order_release);
+    event_free(ts->interval_timer);
+    ts->interval_timer = NULL;
+    ts->interval = NULL;
+    return;
+  }
+
+  b->current = k + 1;
+  b->live().start = s.stop;
+}
 
 /* The follow are C trampolines for libevent callbacks. */
+thread_local uint64_t loop_events = 0;
+
+template <class S>
 void bev_event_cb(struct bufferevent *bev, short events, void *ptr) {
   server_t* serv = (server_t*) ptr;
-  serv->conn->event_callback(serv, events);
+  loop_events++;
+  conn_of<S>(serv)->event_callback(serv, events);
 }
 
+template <class S>
 void bev_read_cb(struct bufferevent *bev, void *ptr) {
   server_t* serv = (server_t*) ptr;
-  serv->conn->read_callback(serv);
+  loop_events++;
+  conn_of<S>(serv)->read_callback(serv);
 }
 
+template <class S>
 void bev_write_cb(struct bufferevent *bev, void *ptr) {
   server_t* serv = (server_t*) ptr;
-  serv->conn->write_callback();
+  conn_of<S>(serv)->write_callback(serv);
+}
+
+template <class S>
+void bev_output_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info,
+                   void *ptr) {
+  server_t* serv = (server_t*) ptr;
+  conn_of<S>(serv)->output_callback(serv, info);
+}
+
+template <class S>
+void sched_cb(evutil_socket_t fd, short what, void *ptr) {
+  thread_state_t<S>* ts = (thread_state_t<S>*) ptr;
+  loop_events++;
+  ts->sched_armed = 0.0;
+  run_scheduler(ts);
+}
+
+template <class S>
+void reconnect_cb(evutil_socket_t fd, short what, void *ptr) {
+  server_t* serv = (server_t*) ptr;
+  loop_events++;
+  conn_of<S>(serv)->reconnect_callback(serv);
+}
+
+template <class S>
+void rx_cb(evutil_socket_t fd, short what, void *ptr) {
+  server_t* serv = (server_t*) ptr;
+  loop_events++;
+  conn_of<S>(serv)->timestamp_read(serv);
+}
+
+template <class S>
+void op_timer_cb(evutil_socket_t fd, short what, void *ptr) {
+  thread_state_t<S>* ts = (thread_state_t<S>*) ptr;
+  // Not counted in loop_events: only a timeout, not a response.
+  ts->op_armed = 0.0;
+  expire_ops(ts);
+}
+
+template <class S>
+void churn_cb(evutil_socket_t fd, short what, void *ptr) {
+  thread_state_t<S>* ts = (thread_state_t<S>*) ptr;
+  double now = get_time();
+  struct timeval tv;
+
+  loop_events++;
+  if (now > ts->start_time + ts->options.time) return;
+
+  // Catch up on every arrival that came due since the last pass.
+  while (ts->churn_due <= now) {
+    string &host = ts->churn_hosts[ts->churn_next++ % ts->churn_hosts.size()];
+    BasicConnection<S>* conn =
+      new BasicConnection<S>(ts, host, ts->options.churn_requests);
+    ts->churn_active.insert(conn);
+    conn->connect();
+    ts->churn_due += ts->churn_gen->generate();
+  }
+
+  double_to_tv(ts->churn_due - now, &tv);
+  evtimer_add(ts->churn_timer, &tv);
+}
+
+template <class S>
+void rebalance_cb(evutil_socket_t fd, short what, void *ptr) {
+  thread_state_t<S>* ts = (thread_state_t<S>*) ptr;
+  // Not counted in loop_events, like op_timer_cb.
+  rebalance_tick(ts);
+}
+
+template <class S>
+void mailbox_cb(evutil_socket_t fd, short what, void *ptr) {
+  thread_state_t<S>* ts = (thread_state_t<S>*) ptr;
+  loop_events++;
+  rebalance_receive(ts);
 }
 
-void timer_cb(evutil_socket_t fd, short what, void *ptr) {
-  Connection* conn = (Connection*) ptr;
-  conn->timer_callback();
+template <class S>
+void interval_cb(evutil_socket_t fd, short what, void *ptr) {
+  thread_state_t<S>* ts = (thread_state_t<S>*) ptr;
+  // Not counted in loop_events, like op_timer_cb.
+  interval_flip(ts);
 }
 
+// Everything above, once per --sampler policy.
+#define INSTANTIATE(S)                                                  \
+  template class BasicConnection<S>;                                    \
+  template void flush_corked(thread_state_t<S>*);                       \
+  template void connect_pending(thread_state_t<S>*);                    \
+  template void churn_reap(thread_state_t<S>*);                         \
+  template void expire_ops(thread_state_t<S>*);                         \
+  template void run_scheduler(thread_state_t<S>*);                      \
+  template void arm_scheduler(thread_state_t<S>*);                      \
+  template void arm_op_timer(thread_state_t<S>*);                       \
+  template void rebalance_join(thread_state_t<S>*);                     \
+  template void rebalance_leave(thread_state_t<S>*);                    \
+  template void rebalance_tick(thread_state_t<S>*);                     \
+  template void rebalance_receive(thread_state_t<S>*);                  \
+  template void rebalance_incoming(thread_state_t<S>*);                 \
+  template void interval_begin(thread_state_t<S>*, IntervalBuffer<S>*); \
+  template void interval_flip(thread_state_t<S>*, bool);                \
+  template void sched_cb<S>(evutil_socket_t, short, void*);             \
+  template void churn_cb<S>(evutil_socket_t, short, void*);             \
+  template void op_timer_cb<S>(evutil_socket_t, short, void*);          \
+  template void rebalance_cb<S>(evutil_socket_t, short, void*);         \
+  template void mailbox_cb<S>(evutil_socket_t, short, void*);           \
+  template void interval_cb<S>(evutil_socket_t, short, void*);
+
+INSTANTIATE(LogHistogramSampler)
+INSTANTIATE(HdrHistogramSampler)
+INSTANTIATE(HistogramSampler)
+INSTANTIATE(AdaptiveSampler<double>)
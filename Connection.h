@@ -2,7 +2,9 @@
 #ifndef CONNECTION_H
 #define CONNECTION_H
 
-#include <queue>
+#include <atomic>
+#include <deque>
+#include <set>
 #include <string>
 
 #include <event2/bufferevent.h>
@@ -15,13 +17,19 @@
 #include "ConnectionOptions.h"
 #include "ConnectionStats.h"
 #include "Generator.h"
+#include "IntervalStats.h"
+#include "Ketama.h"
 #include "Operation.h"
+#include "RingBuffer.h"
+#include "TimingWheel.h"
 #include "util.h"
 
 using namespace std;
 
 class Connection;
+template <class S> class BasicConnection;
 class Protocol;
+class UringEngine;
 
 enum read_state_enum {
   INIT_READ,
@@ -41,85 +49,329 @@ enum write_state_enum {
   MAX_WRITE_STATE,
 };
 
+// A kernel timestamp and the stream offset it covers (--timestamping).
+typedef struct {
+  uint64_t end;
+  double   time;
+} stamp_t;
+
 typedef struct {
     unsigned int          id;
     string                host;
     string                port;
+    string                name; // As given to -s, for reporting.
+    bool                  unix_socket;
     Connection*           conn;
     Protocol*             prot;
     struct bufferevent*   bev;
-    std::queue<Operation> op_queue;
+    int                   uring_slot;
+    bool                  corked;
+    double                connect_start, setup_start;
+    double                down_since, up_since; // For --reconnect.
+    double                backoff;
+    struct event*         reconnect_timer;
+    RingBuffer<Operation> op_queue;
+    uint64_t              issued; // Ops ever pushed on op_queue.
+    struct event*         rx_event; // --timestamping reads, not the bev.
+    uint32_t              tx_added; // Bytes written since timestamping began.
+    uint64_t              rx_added; // Bytes read since timestamping began.
+    RingBuffer<stamp_t>   tx_stamps, rx_stamps;
     read_state_enum       read_state;
     write_state_enum      write_state;
 } server_t;
 
-void bev_event_cb(struct bufferevent *bev, short events, void *ptr);
-void bev_read_cb(struct bufferevent *bev, void *ptr);
-void bev_write_cb(struct bufferevent *bev, void *ptr);
-void timer_cb(evutil_socket_t fd, short what, void *ptr);
+// A --replicate write, one copy per server that was up, or a --hedge
+// GET and its backup.  Complete once needed copies are acknowledged.
+typedef struct {
+  double   start_time;
+  uint8_t  copies, acks, lost, needed;
+  bool     done; // Completed or failed; copies may still be in flight.
+  uint32_t key;  // --hedge: key index, to send the backup.
+} fanout_t;
+
+// An op's place in the --op_timeout or --hedge wheel: the seq'th op ever
+// issued to serv, still in flight while seq >= issued - op_queue.size().
+typedef struct {
+  server_t* serv;
+  uint64_t  seq;
+} op_ref_t;
+
+// One --cache_aside read: a GET, then on a miss a backend fetch and a
+// fill SET of the same key.
+typedef struct {
+  double   start_time;
+  uint32_t key;     // Key index, to send the fill.
+  bool     miss;    // The GET missed.
+  bool     filling; // The fill SET is out.
+  bool     done;    // Completed or failed.
+} session_t;
+
+// A --cache_aside read waiting on its backend fetch, stale once the
+// Connection has reset() past it.
+template <class S> struct session_ref_t {
+  BasicConnection<S>* conn;
+  uint32_t            id;
+};
+
+// A Connection's entry in the send scheduler, stale once conn has been
+// rescheduled to some other due time.
+template <class S> struct sched_ref_t {
+  BasicConnection<S>* conn;
+  double              due;
+};
+
+// State shared by all Connections on one do_mutilate() thread.  Keeping
+// options, stats and generators here rather than in every Connection is
+// what lets a thread hold 100k+ mostly idle connections.  One per
+// sampler policy S, like everything that logs to stats.
+template <class S> struct thread_state_t {
+  struct event_base*    base;
+  struct evdns_base*    evdns;
+  UringEngine*          uring;
+
+  options_t             options;
+  BasicConnectionStats<S> stats;
+  double                start_time; // Time when the Connections began.
+  int                   node;       // --numa: the node we run on, or -1.
+  const char*           values;     // random_char, or --numa's local copy.
+
+  Generator*            valuesize;
+  Generator*            keysize;
+  KeyGenerator*         keygen;
+  Generator*            iagen;
+
+  int                   busy;   // Servers whose read_state is not IDLE.
+  int                   down;   // Of those, in INIT_READ or CONN_SETUP.
+  vector<server_t*>     corked; // Output held back for flush_corked().
+
+  int                   connecting;    // Servers with a connect in flight.
+  deque<BasicConnection<S>*> connect_queue; // Waiting for --connect_parallel.
+
+  // --churn: short-lived Connections opened by churn_timer.
+  struct event*         churn_timer;
+  Generator*            churn_gen;
+  double                churn_due;
+  vector<string>        churn_hosts;
+  unsigned int          churn_next;
+  set<BasicConnection<S>*> churn_active;
+  vector<BasicConnection<S>*> churn_done; // Retired, freed by churn_reap().
+
+  vector<BasicConnection<S>*> conns; // Running on this thread.
+  KetamaRing*           ring;  // --ketama: which server each key goes to.
+
+  // Send scheduler: when each Connection's write machine is next due.
+  // One evtimer, armed by arm_scheduler() for the earliest, replaces one
+  // per Connection.
+  TimingWheel<sched_ref_t<S>>* sched;
+  struct event*         sched_timer;
+  double                sched_armed; // Deadline sched_timer is set for.
 
+  // --hedge: GETs due a backup, advanced along with sched.  A pN delay
+  // tracks recent GET latency.
+  TimingWheel<op_ref_t>* hedge_wheel;
+  double                hedge_delay;
+  LogHistogramSampler*  hedge_latency;
+  uint64_t              hedge_samples;
+
+  // --cache_aside: reads whose GET missed, each due a fill once its
+  // backend fetch (backend, in us) is over.  Advanced along with sched.
+  Generator*            backend;
+  TimingWheel<session_ref_t<S>>* backend_wheel;
+
+  // --rebalance: how busy this thread is, as the other threads see it,
+  // and the Connections they hand it through the mailbox pipe.
+  struct event*         rebalance_timer;
+  double                idle_time; // Non-blocking passes that ran nothing.
+  double                cpu_mark, idle_mark, load_time; // At the last tick.
+  atomic<double>        load;
+  int                   mailbox_fd[2];
+  struct event*         mailbox_event;
+  vector<BasicConnection<S>*> mailbox; // Guarded by the rebalance lock.
+  vector<BasicConnection<S>*> moved;   // Left behind by migrations.
+
+  // --report: the interval being filled, closed by interval_timer.
+  IntervalBuffer<S>*    interval;
+  struct event*         interval_timer;
+
+  // --op_timeout: deadlines of in-flight ops, advanced by op_timer, which
+  // arm_op_timer() sets for the earliest.
+  TimingWheel<op_ref_t>* op_wheel;
+  struct event*         op_timer;
+  double                op_armed; // Deadline op_timer is set for.
+};
+
+template <class S> void flush_corked(thread_state_t<S>* ts);
+template <class S> void connect_pending(thread_state_t<S>* ts);
+template <class S> void churn_reap(thread_state_t<S>* ts);
+template <class S> void expire_ops(thread_state_t<S>* ts);
+template <class S> void run_scheduler(thread_state_t<S>* ts);
+template <class S> void arm_scheduler(thread_state_t<S>* ts);
+template <class S> void arm_op_timer(thread_state_t<S>* ts);
+template <class S> void rebalance_join(thread_state_t<S>* ts);
+template <class S> void rebalance_leave(thread_state_t<S>* ts);
+template <class S> void rebalance_tick(thread_state_t<S>* ts);
+template <class S> void rebalance_receive(thread_state_t<S>* ts);
+template <class S> void rebalance_incoming(thread_state_t<S>* ts);
+template <class S> void interval_begin(thread_state_t<S>* ts,
+                                       IntervalBuffer<S>* interval);
+template <class S> void interval_flip(thread_state_t<S>* ts, bool last = false);
+
+template <class S> void bev_event_cb(struct bufferevent *bev, short events,
+                                     void *ptr);
+template <class S> void bev_read_cb(struct bufferevent *bev, void *ptr);
+template <class S> void bev_write_cb(struct bufferevent *bev, void *ptr);
+template <class S> void bev_output_cb(struct evbuffer *buf,
+                                      const struct evbuffer_cb_info *info,
+                                      void *ptr);
+template <class S> void sched_cb(evutil_socket_t fd, short what, void *ptr);
+template <class S> void churn_cb(evutil_socket_t fd, short what, void *ptr);
+template <class S> void reconnect_cb(evutil_socket_t fd, short what, void *ptr);
+template <class S> void op_timer_cb(evutil_socket_t fd, short what, void *ptr);
+template <class S> void rx_cb(evutil_socket_t fd, short what, void *ptr);
+template <class S> void rebalance_cb(evutil_socket_t fd, short what, void *ptr);
+template <class S> void mailbox_cb(evutil_socket_t fd, short what, void *ptr);
+template <class S> void interval_cb(evutil_socket_t fd, short what, void *ptr);
+
+// Callbacks dispatched on this thread, bumped by the trampolines so the
+// event loop can tell a busy pass from an empty one (see --spin).
+extern thread_local uint64_t loop_events;
+
+// What a server's Protocol and the UringEngine see of the Connection
+// that owns it, whatever its sampler policy.
 class Connection {
 public:
-  Connection(struct event_base* _base, struct evdns_base* _evdns,
-             options_t options, string host, bool sampling = true);
-  ~Connection();
+  Connection(options_t& _options, ConnectionStats& _counters) :
+    options(_options), counters(_counters) {}
+  virtual ~Connection() {}
 
-  double start_time; // Time when this connection began operations.
-  ConnectionStats stats;
-  options_t options;
+  options_t& options;        // Both shared through thread_state_t.
+  ConnectionStats& counters; // Its stats, less the samplers.
+
+  virtual void set_leader(unsigned int id) = 0;
+  virtual unsigned int get_leader() = 0;
+  virtual void print_load_state() = 0;
+  virtual void event_callback(server_t* serv, short events) = 0;
+  virtual void read_callback(server_t* serv) = 0;
+};
+
+template <class S> class BasicConnection final : public Connection {
+public:
+  BasicConnection(thread_state_t<S>* _ts, string host, int _churn_left = -1);
+  BasicConnection(thread_state_t<S>* _ts, const BasicConnection<S>& from,
+                  const vector<evutil_socket_t>& fds);
+  virtual ~BasicConnection();
+
+  BasicConnectionStats<S>& stats;
 
-  bool is_ready();
   void set_priority(int pri);
-  void set_leader(unsigned int id);
-  unsigned int get_leader();
+  virtual void set_leader(unsigned int id);
+  virtual unsigned int get_leader();
 
   // state commands
+  void connect();
   void start() { drive_write_machine(leader); }
   void start_loading();
   void reset();
   bool check_exit_condition(double now = 0.0);
-  void print_load_state();
+  bool spill(double intended, double now);
+  bool moving() { return migrate_to != NULL; }
+  void move_to(thread_state_t<S>* to) { migrate_to = to; }
+  void adopt();
+  int incoming_node();
+  virtual void print_load_state();
 
   // event callbacks
-  void event_callback(server_t* serv, short events);
-  void read_callback(server_t* serv);
-  void write_callback();
-  void timer_callback();
+  virtual void event_callback(server_t* serv, short events);
+  virtual void read_callback(server_t* serv);
+  void write_callback(server_t* serv);
+  void output_callback(server_t* serv, const struct evbuffer_cb_info *info);
+  void sched_callback(double due);
+  void reconnect_callback(server_t* serv);
+  void timeout_op(server_t* serv, uint64_t seq);
+  void hedge_op(server_t* serv, uint64_t seq);
+  void backend_done(uint32_t id);
+  void timestamp_read(server_t* serv);
 
 private:
   vector<server_t> servers;
   server_t* leader;
 
-  struct event_base *base;
-  struct evdns_base *evdns;
+  thread_state_t<S>* ts;
 
-  struct event *timer; // Used to control inter-transmission time.
+  double sched_due;    // When the scheduler will next drive us, or 0.
   double next_time;    // Inter-transmission time parameters.
+  double last_intended; // next_time of the previous scheduled send.
   double last_rx;      // Used to moderate transmission rate.
   double last_tx;
 
   // Parameters to track progress of the data loader.
   int loader_issued, loader_completed;
 
-  Generator *valuesize;
-  Generator *keysize;
-  KeyGenerator *keygen;
-  Generator *iagen;
+  int churn_left; // Requests left before a --churn Connection retires.
+  RingBuffer<double> backlog; // Intended times of --open_loop arrivals.
+  bool retired;
+
+  // --ketama: keys pick their server off ts->ring, --replicate and
+  // --hedge: reads pick a replica and writes may go to all.  Either way
+  // the leader only paces, so --depth bounds the requests in flight on
+  // all servers.
+  bool routed;
+  size_t in_flight; // A fan-out counts once, until it completes.
+
+  RingBuffer<fanout_t> fanouts; // --replicate writes, oldest first.
+  uint32_t fanout_head;         // Operation::fanout of fanouts.front().
+
+  RingBuffer<session_t> sessions; // --cache_aside reads, oldest first.
+  uint32_t session_head;          // Operation::session of sessions.front().
+  size_t backend_waits;           // Sessions in a backend fetch.
+
+  thread_state_t<S>* migrate_to;   // --rebalance: move there once drained.
+  vector<evutil_socket_t> adopted; // Sockets to attach() on the new thread.
 
   // server functions
   server_t parse_hoststring(string s);
+  void attach(server_t &serv, evutil_socket_t fd);
   void connect_server(server_t &serv);
+  void fail_server(server_t* serv);
+  void setup_done(server_t* serv);
+  void enable_timestamping(server_t* serv, int fd);
+  void log_kernel(server_t* serv, Operation* op);
+  server_stats_t& server_stats(server_t* serv);
 
   // state machine functions / event processing
+  void set_read_state(server_t* serv, read_state_enum state);
+  bool try_migrate(double now);
+  bool migrate();
+  void churn_next();
+  server_t* fan_out(const char* key, const char* value, int length,
+                    double now);
+  void fanout_ack(Operation* op, bool acked);
+  void hedge_get(server_t* serv, const char* key, int key_index, double now);
+  void hedge_sample(double t);
+  void session_get(server_t* serv, const char* key, int key_index,
+                   double now);
+  void session_step(Operation* op, bool ok);
+  void session_end(session_t &s);
+  void lose_op(server_t* serv);
+  void push_op(server_t* serv, const Operation& op, double now);
   void pop_op(server_t* serv);
   void finish_op(server_t* serv, Operation *op);
-  void issue_something(server_t* serv, double now = 0.0);
+  void load_key(const char* key);
+  server_t* route(const char* key);
+  size_t outstanding(server_t* serv);
+  bool full(server_t* serv);
+  server_t* issue_something(server_t* serv, double now = 0.0);
   void drive_write_machine(server_t* serv, double now = 0.0);
+  void set_intended(server_t* serv, double intended, double now);
+  void schedule(double when);
+  bool backlog_ready(server_t* serv);
+  void overflow(double intended, double now);
 
   // request functions
-  void issue_get(server_t* serv, const char* key, double now = 0.0);
+  void issue_get(server_t* serv, const char* key, double now = 0.0,
+                 uint32_t fanout = 0);
   void issue_set(server_t* serv, const char* key, const char* value,
-                 int length, double now = 0.0);
+                 int length, double now = 0.0, uint32_t fanout = 0);
 };
 
 #endif
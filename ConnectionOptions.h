@@ -3,9 +3,45 @@
 
 #include "distributions.h"
 
+enum open_loop_enum { OPEN_LOOP_OFF, OPEN_LOOP_QUEUE, OPEN_LOOP_DROP,
+                      OPEN_LOOP_SPILL };
+enum replicate_enum { REPLICATE_OFF, REPLICATE_FIRST, REPLICATE_QUORUM,
+                      REPLICATE_ALL };
+enum sampler_enum { SAMPLER_LOG, SAMPLER_HDR, SAMPLER_LINEAR,
+                    SAMPLER_EXACT };
+
 typedef struct {
   int    connections;
   bool   blocking;
+  bool   io_uring;
+  int    spin;
+  int    busy_poll;
+  bool   cork;
+  double churn;          // Connections per second, per thread.
+  int    churn_requests;
+  int    connect_parallel;
+  double connect_timeout;
+  bool   reconnect;
+  double backoff_min, backoff_max;
+  int    op_timeout;     // Microseconds.
+  bool   timeout_wait;
+  bool   timestamping;
+  int    open_loop;      // open_loop_enum.
+  bool   ketama;
+  int    replicate;      // replicate_enum.
+  int    read_replica;   // 1-based, 0 for random.
+  bool   hedge;
+  double hedge_delay;    // Microseconds, or 0 to track hedge_nth.
+  double hedge_nth;      // Percentile of GET latency.
+  double rebalance;      // Seconds between load checks, or 0.
+  bool   numa;
+  bool   numa_incoming;
+  double report;         // Seconds per interval report, or 0.
+  int    measure_threads;
+  bool   probe;          // This is a --measure_threads thread.
+  bool   cache_aside;
+  char   backend[32];    // --cache_aside backend delay (us).
+  int    sampler;        // sampler_enum.
   double lambda;
   int    qps;
   int    records;
@@ -4,59 +4,67 @@
 
 #include <algorithm>
 #include <inttypes.h>
+#include <map>
+#include <string>
 #include <vector>
 
-#ifdef USE_ADAPTIVE_SAMPLER
-#include "AdaptiveSampler.h"
-#elif defined(USE_HISTOGRAM_SAMPLER)
-#include "HistogramSampler.h"
-#else
-#include "LogHistogramSampler.h"
-#endif
+#include "Sampler.h"
 #include "AgentStats.h"
 #include "Operation.h"
 
 using namespace std;
 
+// Availability of one server under --reconnect.  An outage runs from a
+// failure until the reconnect; recovery from the reconnect until the
+// first response after it.
+typedef struct {
+  uint64_t failures;
+  uint64_t errors;     // In-flight or unsendable requests.
+  uint64_t outages;    // Outages that have recovered.
+  double   outage_sum, outage_max;
+  double   recovery_sum, recovery_max;
+} server_stats_t;
+
+// The counters, which every sampler policy shares, and the GETs and SETs
+// behind --save and --archive, kept while save_samples is set.
 class ConnectionStats {
  public:
- ConnectionStats(bool _sampling = true) :
-#ifdef USE_ADAPTIVE_SAMPLER
-   get_sampler(100000), set_sampler(100000), op_sampler(100000),
-#elif defined(USE_HISTOGRAM_SAMPLER)
-   get_sampler(10000,1), set_sampler(10000,1), op_sampler(1000,1),
-#else
-   get_sampler(200), set_sampler(200), op_sampler(100),
-#endif
-   rx_bytes(0), tx_bytes(0), gets(0), sets(0),
-   get_misses(0), gets_sent(0), skips(0), sampling(_sampling) {}
-
-#ifdef USE_ADAPTIVE_SAMPLER
-  AdaptiveSampler<Operation> get_sampler;
-  AdaptiveSampler<Operation> set_sampler;
-  AdaptiveSampler<double> op_sampler;
-#elif defined(USE_HISTOGRAM_SAMPLER)
-  HistogramSampler get_sampler;
-  HistogramSampler set_sampler;
-  HistogramSampler op_sampler;
-#else
-  LogHistogramSampler get_sampler;
-  LogHistogramSampler set_sampler;
-  LogHistogramSampler op_sampler;
-#endif
+ ConnectionStats(bool _sampling = true, bool _save_samples = false) :
+   rx_bytes(0), tx_bytes(0), tx_writes(0), gets(0), sets(0),
+   get_misses(0), gets_sent(0), skips(0), drops(0), spills(0), churns(0),
+   errors(0), timeouts(0), fanouts(0), fanout_fails(0),
+   hedges(0), hedge_wins(0), hedge_late(0), migrations(0),
+   fills(0), kernel_skips(0),
+   sampling(_sampling), save_samples(_save_samples) {}
 
   uint64_t rx_bytes, tx_bytes;
+  uint64_t tx_writes; // write() calls, or io_uring sends.
   uint64_t gets, sets, get_misses;
   int gets_sent; //ANA
   uint64_t skips;
+  uint64_t drops;  // --open_loop=drop arrivals.
+  uint64_t spills; // --open_loop=spill arrivals sent on another connection.
+  uint64_t churns; // --churn connections opened and closed.
+  uint64_t errors; // Requests lost to failed connections.
+  uint64_t timeouts; // Requests past --op_timeout.
+  uint64_t fanouts, fanout_fails; // --replicate writes.
+  uint64_t hedges;     // --hedge backup GETs sent.
+  uint64_t hedge_wins; // Backups that answered first.
+  uint64_t hedge_late; // Duplicate answers drained.
+  uint64_t migrations; // --rebalance moves to another thread.
+  uint64_t fills;      // --cache_aside SETs after a miss.
+  uint64_t kernel_skips; // --timestamping stamps that made no sense.
+
+  map<string, server_stats_t> server_stats; // By -s name: host:port, or unix:<path>.
 
   double start, stop;
 
-  bool sampling;
+  // Per-thread event loop time spent polling vs. blocked, in seconds.
+  vector<double> spin_time, sleep_time;
 
-  void log_get(Operation& op) { if (sampling) get_sampler.sample(op); gets++; }
-  void log_set(Operation& op) { if (sampling) set_sampler.sample(op); sets++; }
-  void log_op (double op)     { if (sampling)  op_sampler.sample(op); }
+  bool sampling;
+  bool save_samples;         // --save or --archive.
+  vector<Operation> samples; // In completion order, until sorted.
 
   double get_qps() {
     return (gets + sets) / (stop - start);
@@ -68,51 +76,45 @@ class ConnectionStats {
   double get_setqps() {
     return (sets) / (stop - start);
   }
-#ifdef USE_ADAPTIVE_SAMPLER
-  double get_nth(double nth) {
-    vector<double> samples;
-
-    if (samples.size() == 0) return 0;
-
-    for (auto s: get_sampler.samples)
-      samples.push_back(s.time());
-    for (auto s: set_sampler.samples)
-      samples.push_back(s.time());
-
-    sort(samples.begin(), samples.end());
-
-    int l = samples.size();
-    int i = (int)((nth * l) / 100);
-
-    assert(i < l);
-
-    return samples[i];
-  }
-#else
-  double get_nth(double nth) {
-    // FIXME: nth across gets & sets?
-    return get_sampler.get_nth(nth);
-  }
-#endif
 
   void accumulate(const ConnectionStats &cs) {
-#ifdef USE_ADAPTIVE_SAMPLER
-    for (auto i: cs.get_sampler.samples) get_sampler.sample(i);
-    for (auto i: cs.set_sampler.samples) set_sampler.sample(i);
-    for (auto i: cs.op_sampler.samples)  op_sampler.sample(i);
-#else
-    get_sampler.accumulate(cs.get_sampler);
-    set_sampler.accumulate(cs.set_sampler);
-    op_sampler.accumulate(cs.op_sampler);
-#endif
-
     rx_bytes += cs.rx_bytes;
     tx_bytes += cs.tx_bytes;
+    tx_writes += cs.tx_writes;
     gets += cs.gets;
     sets += cs.sets;
     get_misses += cs.get_misses;
     skips += cs.skips;
+    drops += cs.drops;
+    spills += cs.spills;
+    churns += cs.churns;
+    errors += cs.errors;
+    timeouts += cs.timeouts;
+    fanouts += cs.fanouts;
+    fanout_fails += cs.fanout_fails;
+    hedges += cs.hedges;
+    hedge_wins += cs.hedge_wins;
+    hedge_late += cs.hedge_late;
+    migrations += cs.migrations;
+    fills += cs.fills;
+    kernel_skips += cs.kernel_skips;
+
+    for (auto &i: cs.server_stats) {
+      server_stats_t &s = server_stats[i.first];
+      s.failures += i.second.failures;
+      s.errors += i.second.errors;
+      s.outages += i.second.outages;
+      s.outage_sum += i.second.outage_sum;
+      s.outage_max = max(s.outage_max, i.second.outage_max);
+      s.recovery_sum += i.second.recovery_sum;
+      s.recovery_max = max(s.recovery_max, i.second.recovery_max);
+    }
 
+    spin_time.insert(spin_time.end(),
+                     cs.spin_time.begin(), cs.spin_time.end());
+    sleep_time.insert(sleep_time.end(),
+                      cs.sleep_time.begin(), cs.sleep_time.end());
+    samples.insert(samples.end(), cs.samples.begin(), cs.samples.end());
 
     gets_sent += cs.gets_sent;
     start = cs.start;
@@ -136,61 +138,136 @@ class ConnectionStats {
                  "#type", "avg", "std", "min", "5th", "10th", "50th",
                  "90th", "95th", "99th", "max");
   }
+};
 
-#ifdef USE_ADAPTIVE_SAMPLER
-  void print_stats(FILE* out, const char *tag,
-                   AdaptiveSampler<Operation> &sampler, bool newline = true) {
-    vector<double> copy;
-
-    for (auto i: sampler.samples) copy.push_back(i.time());
-    size_t l = copy.size();
-
-    if (l == 0) {
-      fprintf(out, "%-7s %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f",
-              tag, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0);
-      if (newline) fprintf(out, "\n");
-      return;
+// The latency samplers, of policy S (see Sampler.h).
+template <class S> class BasicConnectionStats : public ConnectionStats {
+ public:
+ BasicConnectionStats(bool _sampling = true, bool _save_samples = false) :
+   ConnectionStats(_sampling, _save_samples),
+   get_sampler(make_sampler<S>(200)), set_sampler(make_sampler<S>(200)),
+   op_sampler(make_sampler<S>(100)),
+   connect_sampler(make_sampler<S>(200)), sasl_sampler(make_sampler<S>(200)),
+   first_sampler(make_sampler<S>(200)),
+   timeout_sampler(make_sampler<S>(200)),
+   kernel_sampler(make_sampler<S>(200)),
+   client_sampler(make_sampler<S>(200)),
+   response_sampler(make_sampler<S>(200)),
+   lag_sampler(make_sampler<S>(200)),
+   backlog_sampler(make_sampler<S>(100)),
+   queued_sampler(make_sampler<S>(200)),
+   dispatch_sampler(make_sampler<S>(200)),
+   pacing_sampler(make_sampler<S>(200)),
+   fanout_sampler(make_sampler<S>(200)), app_sampler(make_sampler<S>(200)) {}
+
+  S get_sampler;
+  S set_sampler;
+  S op_sampler;
+  S connect_sampler;  // Connection setup latencies (us).
+  S sasl_sampler;
+  S first_sampler;
+  S timeout_sampler;  // Age of ops past --op_timeout.
+  S kernel_sampler;   // --timestamping: TX to RX in kernel.
+  S client_sampler;   // The rest of each op's latency.
+  S response_sampler; // From the intended send time.
+  S lag_sampler;      // Actual minus intended send time.
+  S backlog_sampler;  // --open_loop backlog per arrival.
+  S queued_sampler;   // Time arrivals spent in it (us).
+  S dispatch_sampler; // Send scheduler lateness (us).
+  S pacing_sampler;   // |achieved - intended| gap (us).
+  S fanout_sampler;   // --replicate write completion.
+  S app_sampler;      // --cache_aside session latency.
+
+  // --ketama: latency of the requests routed to each server, indexed
+  // like the ring.
+  vector<S> server_samplers;
+
+  void log_get(Operation& op) {
+    if (sampling) {
+      get_sampler.sample(op.time());
+      if (save_samples) samples.push_back(op);
+    }
+    gets++;
+  }
+  void log_set(Operation& op) {
+    if (sampling) {
+      set_sampler.sample(op.time());
+      if (save_samples) samples.push_back(op);
     }
+    sets++;
+  }
+  void log_op (double op)     { if (sampling)  op_sampler.sample(op); }
+  void log_connect(double t)  { if (sampling) connect_sampler.sample(t); }
+  void log_sasl(double t)     { if (sampling) sasl_sampler.sample(t); }
+  void log_first(double t)    { if (sampling) first_sampler.sample(t); }
+  void log_timeout(double t)  { if (sampling) timeout_sampler.sample(t); }
+  void log_backlog(double n)  { if (sampling) backlog_sampler.sample(n); }
+  void log_queued(double t)   { if (sampling) queued_sampler.sample(t); }
+  void log_dispatch(double t) { if (sampling) dispatch_sampler.sample(t); }
+  void log_pacing(double t)   { if (sampling) pacing_sampler.sample(t); }
+  void log_fanout(double t) {
+    if (sampling) fanout_sampler.sample(t);
+    fanouts++;
+  }
+  void log_app(double t)      { if (sampling) app_sampler.sample(t); }
 
-    sort(copy.begin(), copy.end());
+  void log_server(unsigned int server, double t) {
+    if (!sampling) return;
+    if (server >= server_samplers.size())
+      server_samplers.resize(server + 1, make_sampler<S>(200));
+    server_samplers[server].sample(t);
+  }
 
-    fprintf(out, "%-7s %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f",
-            tag, std::accumulate(copy.begin(), copy.end(), 0.0) / l,
-            copy[0], copy[(l*1) / 100], copy[(l*5) / 100], copy[(l*10) / 100],
-            copy[(l*90) / 100], copy[(l*95) / 100], copy[(l*99) / 100]
-            );
-    if (newline) fprintf(out, "\n");
+  void log_intended(const Operation& op) {
+    if (!sampling) return;
+    response_sampler.sample(op.response_time());
+    lag_sampler.sample(op.lag());
   }
 
-  void print_stats(FILE* out, const char *tag,
-                   AdaptiveSampler<double> &sampler, bool newline = true) {
-    vector<double> copy;
+  void log_kernel(double kernel, double client) {
+    if (!sampling) return;
+    kernel_sampler.sample(kernel);
+    client_sampler.sample(client);
+  }
 
-    for (auto i: sampler.samples) copy.push_back(i);
-    size_t l = copy.size();
+  double get_nth(double nth) {
+    // FIXME: nth across gets & sets?
+    return get_sampler.get_nth(nth);
+  }
 
-    if (l == 0) {
-      fprintf(out, "%-7s 0", tag);
-      if (newline) fprintf(out, "\n");
-      return;
-    }
+  using ConnectionStats::accumulate; // AgentStats, from the master.
 
-    sort(copy.begin(), copy.end());
+  void accumulate(const BasicConnectionStats<S> &cs) {
+    ConnectionStats::accumulate(cs);
 
-    fprintf(out, "%-7s %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f",
-            tag, std::accumulate(copy.begin(), copy.end(), 0.0) / l,
-            copy[0], copy[(l*1) / 100], copy[(l*5) / 100], copy[(l*10) / 100],
-            copy[(l*90) / 100], copy[(l*95) / 100], copy[(l*99) / 100], 0.0);
-    if (newline) fprintf(out, "\n");
+    get_sampler.accumulate(cs.get_sampler);
+    set_sampler.accumulate(cs.set_sampler);
+    op_sampler.accumulate(cs.op_sampler);
+    connect_sampler.accumulate(cs.connect_sampler);
+    sasl_sampler.accumulate(cs.sasl_sampler);
+    first_sampler.accumulate(cs.first_sampler);
+    timeout_sampler.accumulate(cs.timeout_sampler);
+    kernel_sampler.accumulate(cs.kernel_sampler);
+    client_sampler.accumulate(cs.client_sampler);
+    response_sampler.accumulate(cs.response_sampler);
+    lag_sampler.accumulate(cs.lag_sampler);
+    backlog_sampler.accumulate(cs.backlog_sampler);
+    queued_sampler.accumulate(cs.queued_sampler);
+    dispatch_sampler.accumulate(cs.dispatch_sampler);
+    pacing_sampler.accumulate(cs.pacing_sampler);
+    fanout_sampler.accumulate(cs.fanout_sampler);
+    app_sampler.accumulate(cs.app_sampler);
+
+    for (size_t i = 0; i < cs.server_samplers.size(); i++) {
+      if (i < server_samplers.size())
+        server_samplers[i].accumulate(cs.server_samplers[i]);
+      else
+        server_samplers.push_back(cs.server_samplers[i]);
+    }
   }
 
-#elif defined(USE_HISTOGRAM_SAMPLER)
-  void print_stats(FILE* out, const char *tag, HistogramSampler &sampler,
-                   bool newline = true) {
-#else /* LOGHISTOGRAMSAMPLER */
-  void print_stats(FILE* out, const char *tag, LogHistogramSampler &sampler,
+  void print_stats(FILE* out, const char *tag, S &sampler,
                    bool newline = true) {
-#endif
     if (sampler.total() == 0) {
       fprintf(out, "%-7s %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f %7.1f",
               tag, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0);
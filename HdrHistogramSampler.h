@@ -0,0 +1,240 @@
+/* -*- c++ -*- */
+#ifndef HDRHISTOGRAMSAMPLER_H
+#define HDRHISTOGRAMSAMPLER_H
+
+#include <assert.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "log.h"
+#include "Operation.h"
+
+// High dynamic range histogram, laid out as HdrHistogram does it.
+// Samples are counted in units of lowest, the smallest value told apart
+// from zero, and kept to digits significant decimal digits from there
+// up to highest: each power of two range holds sub_count / 2 linear
+// buckets, so the relative error anywhere is below 1 / 10^digits.
+// Samples past highest count as highest.  Two histograms of the same
+// layout merge without loss, and serialize() writes one out compactly.
+
+class HdrHistogramSampler {
+public:
+  std::vector<uint64_t> bins;
+
+  double lowest, highest;
+  int digits;
+
+  uint64_t count;
+  double sum, sum_sq;
+  double min, max; // Exact, not bucket values.
+
+  HdrHistogramSampler() = delete;
+  HdrHistogramSampler(double _lowest, double _highest, int _digits) :
+    lowest(_lowest), highest(_highest), digits(_digits) {
+    assert(lowest > 0 && highest >= 2 * lowest);
+    assert(digits >= 1 && digits <= 5);
+
+    // Enough linear buckets per power of two for digits of precision.
+    double largest = 2 * pow(10, digits);
+    sub_magnitude = (int) ceil(log2(largest));
+    sub_count = 1 << sub_magnitude;
+    sub_mask = sub_count - 1;
+
+    uint64_t top = (uint64_t) ceil(highest / lowest);
+    int buckets = 1;
+    for (uint64_t reach = sub_count; reach <= top; reach <<= 1) buckets++;
+
+    bins.resize((buckets + 1) * (sub_count / 2), 0);
+    clear_totals();
+  }
+
+  void sample(const Operation &op) {
+    sample(op.time());
+  }
+
+  void sample(double s) {
+    assert(s >= 0);
+    bins[index(units(s))]++;
+
+    count++;
+    sum += s;
+    sum_sq += s*s;
+    if (s < min) min = s;
+    if (s > max) max = s;
+  }
+
+  double average() {
+    return sum / count;
+  }
+
+  double stddev() {
+    return sqrt(sum_sq / count - pow(sum / count, 2.0));
+  }
+
+  double minimum() {
+    if (count == 0) DIE("Not implemented");
+    return min;
+  }
+
+  double maximum() {
+    if (count == 0) DIE("Not implemented");
+    return max;
+  }
+
+  /**
+   * Return the highest value equivalent to the nth percentile's bucket,
+   * as HdrHistogram does, within the exact min and max.
+   */
+  double get_nth(double nth) {
+    uint64_t n = 0;
+    double target = count * nth/100;
+
+    for (size_t i = 0; i < bins.size(); i++) {
+      n += bins[i];
+
+      if (n > target) {
+        double v = (value(i) + range(i) - 1) * lowest;
+        return std::max(min, std::min(max, v));
+      }
+    }
+
+    return max;
+  }
+
+  uint64_t total() {
+    return count;
+  }
+
+  void accumulate(const HdrHistogramSampler &h) {
+    assert(bins.size() == h.bins.size() && lowest == h.lowest &&
+           digits == h.digits);
+
+    for (size_t i = 0; i < bins.size(); i++) bins[i] += h.bins[i];
+
+    count += h.count;
+    sum += h.sum;
+    sum_sq += h.sum_sq;
+    min = std::min(min, h.min);
+    max = std::max(max, h.max);
+  }
+
+  /**
+   * The layout, totals and non-empty buckets on one line: each bucket
+   * count, with a run of empty buckets written as minus its length.
+   */
+  std::string serialize() {
+    std::string out;
+    char buf[256];
+
+    snprintf(buf, sizeof(buf), "hdr1 %g %g %d %" PRIu64 " %.17g %.17g %.17g "
+             "%.17g", lowest, highest, digits, count, sum, sum_sq,
+             count ? min : 0.0, count ? max : 0.0);
+    out = buf;
+
+    size_t last = bins.size();
+    while (last > 0 && bins[last - 1] == 0) last--;
+
+    for (size_t i = 0; i < last;) {
+      size_t run = 0;
+      while (i + run < last && bins[i + run] == 0) run++;
+
+      if (run > 1) {
+        snprintf(buf, sizeof(buf), " -%zu", run);
+        i += run;
+      } else {
+        snprintf(buf, sizeof(buf), " %" PRIu64, bins[i]);
+        i++;
+      }
+      out += buf;
+    }
+
+    return out;
+  }
+
+  /**
+   * Add what serialize() wrote for a histogram of the same layout, as
+   * accumulate() would.  Returns false if s is not one.
+   */
+  bool deserialize(const char* s) {
+    double l, h, su, sq, mn, mx;
+    int d, used;
+    uint64_t c;
+
+    if (sscanf(s, "hdr1 %lg %lg %d %" SCNu64 " %lg %lg %lg %lg%n", &l, &h, &d,
+               &c, &su, &sq, &mn, &mx, &used) != 8)
+      return false;
+    if (l != lowest || h != highest || d != digits) return false;
+
+    std::vector<uint64_t> add(bins.size(), 0);
+    size_t i = 0;
+    char* p = (char*) s + used;
+    while (*p) {
+      char* end;
+      long long v = strtoll(p, &end, 10);
+      if (end == p) break;
+      p = end;
+
+      if (v < 0) i += -v;
+      else if (i < add.size()) add[i++] = v;
+      else return false;
+    }
+
+    for (size_t j = 0; j < bins.size(); j++) bins[j] += add[j];
+    if (c > 0) {
+      min = count ? std::min(min, mn) : mn;
+      max = count ? std::max(max, mx) : mx;
+    }
+    count += c;
+    sum += su;
+    sum_sq += sq;
+    return true;
+  }
+
+private:
+  int sub_magnitude;
+  uint64_t sub_count, sub_mask;
+
+  void clear_totals() {
+    count = 0;
+    sum = sum_sq = 0.0;
+    min = INFINITY;
+    max = 0.0;
+  }
+
+  uint64_t units(double s) {
+    double u = s / lowest;
+    double top = highest / lowest;
+    return (uint64_t) (u < top ? u : top);
+  }
+
+  size_t index(uint64_t v) {
+    int bucket = 64 - __builtin_clzll(v | sub_mask) - sub_magnitude;
+    uint64_t sub = v >> bucket;
+    return ((size_t) (bucket + 1) << (sub_magnitude - 1)) + sub - sub_count / 2;
+  }
+
+  // The lowest value, in units, that lands in bins[i].
+  uint64_t value(size_t i) {
+    int bucket = (int) (i >> (sub_magnitude - 1)) - 1;
+    uint64_t sub = (i & (sub_count / 2 - 1)) + sub_count / 2;
+    if (bucket < 0) {
+      sub -= sub_count / 2;
+      bucket = 0;
+    }
+    return sub << bucket;
+  }
+
+  // How many units bins[i] spans.
+  uint64_t range(size_t i) {
+    int bucket = (int) (i >> (sub_magnitude - 1)) - 1;
+    return (uint64_t) 1 << (bucket < 0 ? 0 : bucket);
+  }
+};
+
+#endif // HDRHISTOGRAMSAMPLER_H
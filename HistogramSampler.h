@@ -3,13 +3,16 @@
 #define HISTOGRAMSAMPLER_H
 
 #include <inttypes.h>
+#include <math.h>
 
 #include <assert.h>
+#include <algorithm>
 #include <vector>
 
 #include "Operation.h"
 
-// parameters: # of bins, range? size of bins?
+// Linear histogram: bins width apart up to bins * width, and one
+// overflow bin past that.  Sum, sum of squares and extremes are exact.
 
 class HistogramSampler {
 public:
@@ -17,9 +20,14 @@ public:
   int width;
 
   double overflow_sum;
+  double sum, sum_sq;
+  double min, max;
+  uint64_t count;
 
   HistogramSampler() = delete;
-  HistogramSampler(int _bins, int _width) : overflow_sum(0.0) {
+  HistogramSampler(int _bins, int _width) :
+    overflow_sum(0.0), sum(0.0), sum_sq(0.0), min(INFINITY), max(0.0),
+    count(0) {
     assert(_bins > 0 && _width > 0);
 
     bins.resize(_bins + 1, 0);
@@ -40,58 +48,49 @@ public:
     }
 
     bins[bin]++;
+    count++;
+    sum += s;
+    sum_sq += s*s;
+    if (s < min) min = s;
+    if (s > max) max = s;
   }
 
   double average() {
-    uint64_t count = total();
-    double sum = 0.0;
-
-    for (size_t i = 0; i < bins.size() - 1; i++) {
-      sum += bins[i] * (i*width + (i+1)*width) / 2;
-    }
-
-    sum += overflow_sum;
-
     return sum / count;
   }
 
   double stddev() {
-    // TODO: Implement
-    return 0.0
+    return sqrt(sum_sq / count - pow(sum / count, 2.0));
   }
 
   double minimum() {
-    return get_nth(0);
+    return min;
   }
 
   double maximum() {
-    // TODO: Implement
-    return 0.0
+    return max;
   }
 
   double get_nth(double nth) {
-    uint64_t count = total();
     uint64_t n = 0;
     double target = count * nth/100;
 
-    for (size_t i = 0; i < bins.size(); i++) {
+    for (size_t i = 0; i < bins.size() - 1; i++) {
       n += bins[i];
 
       if (n > target) { // The nth is inside bins[i].
         double left = target - (n - bins[i]);
-        return i*width + left / bins[i] * width;
+        return std::min(max, i*width + left / bins[i] * width);
       }
     }
 
-    return bins.size() * width;
-  } 
+    // Somewhere in the overflow bin; all we know is its mean.
+    return std::max((double) (bins.size() - 1) * width,
+                    overflow_sum / bins.back());
+  }
 
   uint64_t total() {
-    uint64_t sum = 0.0;
-
-    for (auto i: bins) sum += i;
-
-    return sum;
+    return count;
   }
 
   void accumulate(const HistogramSampler &h) {
@@ -100,6 +99,11 @@ public:
     for (size_t i = 0; i < bins.size(); i++) bins[i] += h.bins[i];
 
     overflow_sum += h.overflow_sum;
+    count += h.count;
+    sum += h.sum;
+    sum_sq += h.sum_sq;
+    min = std::min(min, h.min);
+    max = std::max(max, h.max);
   }
 };
 
@@ -0,0 +1,91 @@
+// -*- c++-mode -*-
+#ifndef INTERVALSTATS_H
+#define INTERVALSTATS_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+
+#include "ConnectionStats.h"
+#include "Sampler.h"
+
+using namespace std;
+
+// The ConnectionStats counters --report shows for each interval.
+typedef struct {
+  uint64_t gets, sets, get_misses;
+  uint64_t errors, timeouts;
+  uint64_t rx_bytes, tx_bytes;
+} interval_counts_t;
+
+// What one thread did during one --report interval, sampled with policy S.
+template <class S> class IntervalStats {
+public:
+  IntervalStats() : latency(make_sampler<S>(200)) { clear(); }
+
+  double start, stop;
+  S latency; // GETs and SETs (us).
+  interval_counts_t counts;
+
+  void clear() {
+    start = stop = 0.0;
+    latency = make_sampler<S>(200);
+    memset(&counts, 0, sizeof(counts));
+  }
+
+  /**
+   * Set counts to how far cs has moved on since mark, and move mark up.
+   */
+  void count(const ConnectionStats &cs, interval_counts_t &mark) {
+    interval_counts_t now = {
+      cs.gets, cs.sets, cs.get_misses, cs.errors, cs.timeouts,
+      cs.rx_bytes, cs.tx_bytes,
+    };
+
+    counts.gets = now.gets - mark.gets;
+    counts.sets = now.sets - mark.sets;
+    counts.get_misses = now.get_misses - mark.get_misses;
+    counts.errors = now.errors - mark.errors;
+    counts.timeouts = now.timeouts - mark.timeouts;
+    counts.rx_bytes = now.rx_bytes - mark.rx_bytes;
+    counts.tx_bytes = now.tx_bytes - mark.tx_bytes;
+    mark = now;
+  }
+
+  void accumulate(const IntervalStats<S> &s) {
+    if (start == 0.0 || s.start < start) start = s.start;
+    if (s.stop > stop) stop = s.stop;
+    latency.accumulate(s.latency);
+
+    counts.gets += s.counts.gets;
+    counts.sets += s.counts.sets;
+    counts.get_misses += s.counts.get_misses;
+    counts.errors += s.counts.errors;
+    counts.timeouts += s.counts.timeouts;
+    counts.rx_bytes += s.counts.rx_bytes;
+    counts.tx_bytes += s.counts.tx_bytes;
+  }
+};
+
+// A thread's --report intervals, double-buffered: interval k fills
+// bufs[k & 1].  The thread publishes each one it finishes through ready,
+// and the reporter hands it back cleared through taken, so neither side
+// ever takes a lock.  Owned by the reporter, which outlives the thread.
+template <class S> class IntervalBuffer {
+public:
+  IntervalBuffer() : current(0), ready(0), taken(0), done(false) {
+    memset(&mark, 0, sizeof(mark));
+  }
+
+  IntervalStats<S> bufs[2];
+  uint64_t current;         // Interval being filled.  Thread only.
+  interval_counts_t mark;   // Counters when it began.  Thread only.
+  atomic<uint64_t> ready;   // Intervals finished.
+  atomic<uint64_t> taken;   // Intervals merged and cleared.
+  atomic<bool> done;        // No more after ready.
+
+  IntervalStats<S>& live() { return bufs[current & 1]; }
+};
+
+#endif // INTERVALSTATS_H
@@ -0,0 +1,154 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "Ketama.h"
+#include "log.h"
+
+/**
+ * MD5 (RFC 1321) of len bytes at data.  Only used to place servers and
+ * keys on the ring, so it favours brevity over speed.
+ */
+static void md5(const void* data, size_t len, unsigned char digest[16]) {
+  static const uint32_t K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+    0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+    0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+    0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+    0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+    0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+    0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+    0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+    0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+  };
+  static const int R[64] = {
+    7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+    5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+    4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+    6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21,
+  };
+
+  uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+  const unsigned char* in = (const unsigned char*) data;
+  unsigned char block[64];
+  size_t padded = (len + 8) / 64 * 64 + 64;
+
+  for (size_t off = 0; off < padded; off += 64) {
+    // Message, then 0x80, zeros, and the bit length in the last block.
+    for (int i = 0; i < 64; i++) {
+      size_t n = off + i;
+      if (n < len) block[i] = in[n];
+      else if (n == len) block[i] = 0x80;
+      else if (n >= padded - 8)
+        block[i] = (uint8_t) (((uint64_t) len * 8) >> (8 * (n - padded + 8)));
+      else block[i] = 0;
+    }
+
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+    for (int i = 0; i < 64; i++) {
+      uint32_t f;
+      int g;
+      if (i < 16)      { f = (b & c) | (~b & d); g = i; }
+      else if (i < 32) { f = (d & b) | (~d & c); g = (5 * i + 1) % 16; }
+      else if (i < 48) { f = b ^ c ^ d;          g = (3 * i + 5) % 16; }
+      else             { f = c ^ (b | ~d);       g = (7 * i) % 16; }
+
+      uint32_t m = block[g * 4] | (block[g * 4 + 1] << 8) |
+        (block[g * 4 + 2] << 16) | ((uint32_t) block[g * 4 + 3] << 24);
+      uint32_t t = d;
+      d = c;
+      c = b;
+      f += a + K[i] + m;
+      b += (f << R[i]) | (f >> (32 - R[i]));
+      a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+  }
+
+  for (int i = 0; i < 16; i++) digest[i] = h[i / 4] >> (8 * (i % 4));
+}
+
+/**
+ * The h'th of the four ring points in an MD5 digest, as libketama reads
+ * them.
+ */
+static uint32_t digest_point(const unsigned char digest[16], int h) {
+  return ((uint32_t) digest[3 + h * 4] << 24) | (digest[2 + h * 4] << 16) |
+    (digest[1 + h * 4] << 8) | digest[h * 4];
+}
+
+/**
+ * Build the ring for a list of --server strings.
+ */
+KetamaRing::KetamaRing(const vector<string>& servers) {
+  vector<double> weights;
+  double total = 0.0;
+
+  for (auto &s: servers) {
+    string name = s;
+    double weight = 1.0;
+
+    if (s.compare(0, 5, "unix:")) {
+      size_t colon = s.find(':');
+      if (colon == string::npos) {
+        name = s + ":11211";
+      } else {
+        size_t colon2 = s.find(':', colon + 1);
+        if (colon2 != string::npos) {
+          weight = atof(s.c_str() + colon2 + 1);
+          name = s.substr(0, colon2);
+        }
+      }
+    } else {
+      name = s.substr(5);
+    }
+
+    if (weight <= 0.0) DIE("Invalid --ketama weight: %s", s.c_str());
+    names.push_back(name);
+    weights.push_back(weight);
+    total += weight;
+  }
+
+  for (unsigned int i = 0; i < names.size(); i++) {
+    int ks = floor(weights[i] / total * 40.0 * names.size());
+
+    for (int k = 0; k < ks; k++) {
+      char buf[512];
+      unsigned char digest[16];
+      int l = snprintf(buf, sizeof(buf), "%s-%d", names[i].c_str(), k);
+
+      md5(buf, l, digest);
+      for (int h = 0; h < 4; h++) {
+        point_t p = { digest_point(digest, h), i };
+        points.push_back(p);
+      }
+    }
+  }
+
+  if (points.empty()) DIE("--ketama: no server has any ring points.");
+
+  sort(points.begin(), points.end(),
+       [](const point_t& a, const point_t& b) { return a.point < b.point; });
+}
+
+/**
+ * Return the index of the server a key maps to.
+ */
+unsigned int KetamaRing::lookup(const char* key) const {
+  unsigned char digest[16];
+
+  md5(key, strlen(key), digest);
+  uint32_t h = digest_point(digest, 0);
+
+  auto it = lower_bound(points.begin(), points.end(), h,
+                        [](const point_t& p, uint32_t v) {
+                          return p.point < v;
+                        });
+  if (it == points.end()) it = points.begin(); // Wrap around.
+  return it->server;
+}
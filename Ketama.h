@@ -0,0 +1,37 @@
+// -*- c++-mode -*-
+#ifndef KETAMA_H
+#define KETAMA_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Consistent-hash ring compatible with libketama.  Each server is given
+// as host[:port[:weight]] or unix:<path>, and gets floor(40 * servers *
+// weight / total weight) MD5 digests of "<name>-<n>", each cut into four
+// 32-bit points on the ring.  A key belongs to the server of the first
+// point at or after the first four bytes of its own MD5 digest.
+
+class KetamaRing {
+public:
+  KetamaRing(const vector<string>& servers);
+
+  size_t size() const { return names.size(); }
+  const string& name(unsigned int server) const { return names[server]; }
+
+  unsigned int lookup(const char* key) const;
+
+private:
+  typedef struct {
+    uint32_t     point;
+    unsigned int server;
+  } point_t;
+
+  vector<point_t> points; // Sorted by point.
+  vector<string> names;   // host:port, or the Unix socket path.
+};
+
+#endif // KETAMA_H
@@ -6,46 +6,85 @@
 #include <inttypes.h>
 #include <math.h>
 
+#include <algorithm>
 #include <vector>
 
-#include "mutilate.h"
+#include "log.h"
 #include "Operation.h"
 
 #define _POW 1.1
 
+// Bin lookup for LogHistogramSampler without calling log().  A sample in
+// integer nanoseconds falls in one of 16 slots per power of two, found
+// from its leading zero count and next 4 bits.  A slot is narrower than
+// a _POW bin, so it spans at most two: guess[] holds the bin of its low
+// end, and one compare against bound[] settles which.
+class LogHistogramBins {
+public:
+  static const int SLOTS = 64 * 16;
+  static const int BOUNDS = 512;
+
+  uint16_t guess[SLOTS];
+  uint64_t bound[BOUNDS]; // pow(_POW, b) us in ns, rounded up.
+
+  LogHistogramBins() {
+    for (int b = 0; b < BOUNDS; b++) {
+      double ns = ceil(pow(_POW, b) * 1000);
+      bound[b] = ns < 1.8e19 ? (uint64_t) ns : UINT64_MAX;
+    }
+
+    for (int slot = 0; slot < SLOTS; slot++) {
+      int e = slot / 16, k = slot % 16;
+      uint64_t low = e < 4 ? 0 : (uint64_t) (16 + k) << (e - 4);
+      int b = 0;
+      while (b + 1 < BOUNDS - 1 && bound[b + 1] <= low) b++;
+      guess[slot] = b;
+    }
+  }
+
+  static const LogHistogramBins& get() {
+    static const LogHistogramBins table;
+    return table;
+  }
+
+  size_t lookup(uint64_t ns) const {
+    int e = 63 - __builtin_clzll(ns | 1);
+    int k = e < 4 ? 0 : (ns >> (e - 4)) & 15;
+    size_t b = guess[e * 16 + k];
+    return b + (ns >= bound[b + 1]);
+  }
+};
+
 class LogHistogramSampler {
 public:
   std::vector<uint64_t> bins;
-  std::vector<Operation> samples;
 
   double sum;
   double sum_sq;
+  uint64_t count; // Running sum of bins.
 
   LogHistogramSampler() = delete;
-  LogHistogramSampler(int _bins) : sum(0.0), sum_sq(0.0) {
-    assert(_bins > 0);
+  LogHistogramSampler(int _bins) : sum(0.0), sum_sq(0.0), count(0),
+                                   table(&LogHistogramBins::get()) {
+    assert(_bins > 0 && _bins < LogHistogramBins::BOUNDS - 1);
     bins.resize(_bins + 1, 0);
   }
 
   void sample(const Operation &op) {
     sample(op.time());
-    if (args.save_given || args.archive_given) samples.push_back(op);
   }
 
   void sample(double s) {
     assert(s >= 0);
-    size_t bin = log(s)/log(_POW);
+    uint64_t ns = s < 1.8e16 ? (uint64_t) (s * 1000) : UINT64_MAX;
+    size_t bin = table->lookup(ns);
 
     sum += s;
     sum_sq += s*s;
 
-    if ((int64_t) bin < 0) {
-      bin = 0;
-    } else if (bin >= bins.size()) {
-      bin = bins.size() - 1;
-    }
-
+    if (bin >= bins.size()) bin = bins.size() - 1;
     bins[bin]++;
+    count++;
   }
 
   double average() {
@@ -87,9 +126,26 @@ public:
   } 
 
   uint64_t total() {
-    uint64_t sum = 0.0;
-    for (auto i: bins) sum += i;
-    return sum;
+    return count;
+  }
+
+  void clear() {
+    std::fill(bins.begin(), bins.end(), 0);
+    sum = sum_sq = 0.0;
+    count = 0;
+  }
+
+  /**
+   * Halve every bin, so older samples weigh less than new ones.
+   */
+  void halve() {
+    count = 0;
+    for (auto &b : bins) {
+      b /= 2;
+      count += b;
+    }
+    sum /= 2;
+    sum_sq /= 2;
   }
 
   void accumulate(const LogHistogramSampler &h) {
@@ -97,12 +153,13 @@ public:
 
     for (size_t i = 0; i < bins.size(); i++) bins[i] += h.bins[i];
 
+    count += h.count;
     sum += h.sum;
     sum_sq += h.sum_sq;
-
-    for (auto i: h.samples) samples.push_back(i);
-    std::sort(samples.begin(), samples.end());
   }
+
+private:
+  const LogHistogramBins* table; // Shared by all samplers.
 };
 
 #endif // LOGHISTOGRAMSAMPLER_H
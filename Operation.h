@@ -2,27 +2,56 @@
 #ifndef OPERATION_H
 #define OPERATION_H
 
+#include <math.h>
+#include <stdint.h>
+
 #include <string>
 
 using namespace std;
 
 class Operation {
 public:
-  enum type_enum {
+  enum type_enum : uint8_t {
     GET, GETW,
     SET, SETW
   };
 
+  // Times are integer ns on the clock they were read from; the intended
+  // send time and the etcd switch, as us from start, so a record packs
+  // to 40 bytes.
+  uint64_t start = 0, end = 0;
+  int32_t lead = 0;       // us the arrival process meant it to go sooner.
+  uint32_t switch_us = 0; // us from start to an etcd leader switch.
+  uint32_t tx_end = 0;    // --timestamping offset of the request's last byte.
+  uint32_t fanout = 0;    // --replicate write this is a copy of, or 0.
+  uint32_t session = 0;   // --cache_aside read this is a step of, or 0.
   type_enum type;
-  double start_time, end_time, switch_time;
   uint8_t switched = 0;
+  bool timed_out = false; // Passed --op_timeout under --timeout_wait.
+  bool hedge = false;     // The --hedge backup copy of a GET.
+
+  double start_time() const { return start / 1e9; }
+  double end_time() const { return end / 1e9; }
+  double intended_time() const { return start_time() - lead / 1e6; }
+
+  void set_start(double t) { start = (uint64_t) (t * 1e9); }
+  void set_end(double t) { end = (uint64_t) (t * 1e9); }
+  void set_intended(double t) { lead = lround((start_time() - t) * 1e6); }
+  void set_switch(double t) {
+    switch_us = lround((t - start_time()) * 1e6);
+  }
+
+  double time() const { return (int64_t) (end - start) / 1000.0; }
 
-  double time() const { return (end_time - start_time) * 1000000; }
+  // Measured from the intended send time, so time spent late or blocked
+  // on a full pipeline is not omitted.
+  double response_time() const { return time() + lead; }
+  double lag() const { return lead; }
 
-  double switchCost() const { return (switch_time - start_time) * 1000000; }
+  double switchCost() const { return switch_us; }
 
   bool operator < (const Operation& op) const {
-    return (start_time < op.start_time);
+    return (start < op.start);
   }
 
   const char* toString() {
@@ -364,11 +364,11 @@ bool ProtocolEtcd::handle_response(evbuffer* input, Operation* op) {
 #if USE_CACHED_TIME
         struct timeval now_tv;
         event_base_gettimeofday_cached(base, &now_tv);
-        op->end_time = tv_to_double(&now_tv);
+        op->set_end(tv_to_double(&now_tv));
 #elif HAVE_CLOCK_GETTIME
-        op->end_time = get_time_accurate();
+        op->set_end(get_time_accurate());
 #else
-        op->end_time = get_time();
+        op->set_end(get_time());
 #endif
         printf("Internal Server Error! (Op time: %fus)\n", op->time() / 1000);
         printf("Server: %d, Leader: %d\n", serv.id, serv.conn->get_leader());
@@ -421,11 +421,11 @@ bool ProtocolEtcd::handle_response(evbuffer* input, Operation* op) {
 #if USE_CACHED_TIME
       struct timeval now_tv;
       event_base_gettimeofday_cached(base, &now_tv);
-      op->switch_time = tv_to_double(&now_tv);
+      op->set_switch(tv_to_double(&now_tv));
 #elif HAVE_CLOCK_GETTIME
-      op->switch_time = get_time_accurate();
+      op->set_switch(get_time_accurate());
 #else
-      op->switch_time = get_time();
+      op->set_switch(get_time());
 #endif
       break;
 
@@ -12,8 +12,8 @@ using namespace std;
 
 class Protocol {
 public:
-  Protocol(options_t _opts, server_t& _serv, bufferevent* _bev):
-    opts(_opts), serv(_serv), bev(_bev), stats(_serv.conn->stats) {};
+  Protocol(options_t& _opts, server_t& _serv, bufferevent* _bev):
+    opts(_opts), serv(_serv), bev(_bev), stats(_serv.conn->counters) {};
   virtual ~Protocol() {};
 
   virtual bool setup_connection_w() = 0;
@@ -22,20 +22,16 @@ public:
   virtual int  set_request(const char* key, const char* value, int len) = 0;
   virtual bool handle_response(evbuffer* input, Operation* op) = 0;
 
-  // Functions to pass protocol stats to connection stats object
-  int get_misses_stats() { return stats.get_misses; }
-  int rx_bytes_stats() { return stats.rx_bytes; }
-
 protected:
-  options_t       opts;
-  server_t&       serv;
-  bufferevent*    bev;
-  ConnectionStats stats;
+  options_t&       opts;  // Shared per thread, along with stats.
+  server_t&        serv;
+  bufferevent*     bev;
+  ConnectionStats& stats;
 };
 
 class ProtocolRocksDB : public Protocol {
 public:
-  ProtocolRocksDB(options_t opts, server_t& serv, bufferevent* bev):
+  ProtocolRocksDB(options_t& opts, server_t& serv, bufferevent* bev):
     Protocol(opts, serv, bev) { read_state = IDLE; };
   ~ProtocolRocksDB() {};
 
@@ -59,7 +55,7 @@ private:
 
 class ProtocolAscii : public Protocol {
 public:
-  ProtocolAscii(options_t opts, server_t& serv, bufferevent* bev):
+  ProtocolAscii(options_t& opts, server_t& serv, bufferevent* bev):
     Protocol(opts, serv, bev) { read_state = IDLE; };
   ~ProtocolAscii() {};
 
@@ -83,7 +79,7 @@ private:
 
 class ProtocolBinary : public Protocol {
 public:
-  ProtocolBinary(options_t opts, server_t& serv, bufferevent* bev):
+  ProtocolBinary(options_t& opts, server_t& serv, bufferevent* bev):
     Protocol(opts, serv, bev) {};
   ~ProtocolBinary() {};
 
@@ -96,7 +92,7 @@ public:
 
 class ProtocolEtcd : public Protocol {
 public:
-  ProtocolEtcd(options_t opts, server_t& serv, bufferevent* bev):
+  ProtocolEtcd(options_t& opts, server_t& serv, bufferevent* bev):
     Protocol(opts, serv, bev) { read_state = IDLE; };
   virtual ~ProtocolEtcd() {};
 
@@ -120,7 +116,7 @@ protected:
 
 class ProtocolHttp : public Protocol {
 public:
-  ProtocolHttp(options_t opts, server_t& serv, bufferevent* bev):
+  ProtocolHttp(options_t& opts, server_t& serv, bufferevent* bev):
     Protocol(opts, serv, bev) { read_state = IDLE; };
   virtual ~ProtocolHttp() {};
 
@@ -0,0 +1,88 @@
+// -*- c++-mode -*-
+#ifndef RINGBUFFER_H
+#define RINGBUFFER_H
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+#include "log.h"
+
+#define RING_ALIGN 64 // Cache line.
+
+// FIFO over a cache-aligned, power-of-two array.  Used for the in-flight
+// operations on each server_t: reserve() it once for the deepest
+// pipeline the connection can build, and push()/pop() never touch the
+// allocator again.  Pushing past capacity still works by doubling the
+// array, but that is the slow path.  T must be trivially copyable.
+
+template <class T> class RingBuffer {
+public:
+  RingBuffer() : buf(NULL), mask(0), head(0), tail(0) {}
+
+  RingBuffer(const RingBuffer &r) : buf(NULL), mask(0), head(0), tail(0) {
+    reserve(r.capacity());
+    for (size_t i = 0; i < r.size(); i++) push(r[i]);
+  }
+
+  RingBuffer& operator=(const RingBuffer &r) {
+    if (this == &r) return *this;
+    head = tail = 0;
+    reserve(r.capacity());
+    for (size_t i = 0; i < r.size(); i++) push(r[i]);
+    return *this;
+  }
+
+  ~RingBuffer() { free(buf); }
+
+  size_t size() const { return tail - head; }
+  bool empty() const { return head == tail; }
+  size_t capacity() const { return buf ? mask + 1 : 0; }
+
+  /**
+   * Make room for at least n elements, rounded up to a power of two.
+   */
+  void reserve(size_t n) {
+    if (n <= capacity()) return;
+    size_t c = 1;
+    while (c < n) c <<= 1;
+    resize(c);
+  }
+
+  void push(const T& v) {
+    if (size() == capacity()) resize(capacity() ? capacity() * 2 : 1);
+    new (&buf[tail++ & mask]) T(v);
+  }
+
+  void pop() { head++; }
+
+  T& front() { return buf[head & mask]; }
+  T& back() { return buf[(tail - 1) & mask]; }
+
+  T& operator[](size_t i) { return buf[(head + i) & mask]; }
+  const T& operator[](size_t i) const { return buf[(head + i) & mask]; }
+
+private:
+  T* buf;
+  size_t mask;
+  size_t head, tail; // Free-running; only ever masked on access.
+
+  void resize(size_t n) {
+    void *b;
+    if (posix_memalign(&b, RING_ALIGN, n * sizeof(T)))
+      DIE("posix_memalign(%zu) failed", n * sizeof(T));
+
+    size_t l = size();
+    for (size_t i = 0; i < l; i++)
+      memcpy((T*) b + i, &(*this)[i], sizeof(T));
+
+    free(buf);
+    buf = (T*) b;
+    mask = n - 1;
+    head = 0;
+    tail = l;
+  }
+};
+
+#endif // RINGBUFFER_H
@@ -0,0 +1,65 @@
+/* -*- c++ -*- */
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <string>
+
+#include "AdaptiveSampler.h"
+#include "ConnectionOptions.h"
+#include "HdrHistogramSampler.h"
+#include "HistogramSampler.h"
+#include "LogHistogramSampler.h"
+
+// The sampler policies --sampler picks between.  Each policy S offers
+// sample(double), average(), stddev(), minimum(), maximum(), get_nth(),
+// total() and accumulate(const S&).  ConnectionStats, the Connections
+// and the threads running them are instantiated once per policy, and
+// main() switches on options.sampler to pick one, so a sample costs what
+// the policy itself does.
+
+/**
+ * A sampler of policy S, sized like a LogHistogramSampler of bins: 200
+ * for latencies (us), 100 for counts such as queue depth.
+ */
+template <class S> S make_sampler(int bins);
+
+template <> inline LogHistogramSampler make_sampler(int bins) {
+  return LogHistogramSampler(bins);
+}
+
+template <> inline HdrHistogramSampler make_sampler(int bins) {
+  return bins >= 200 ? HdrHistogramSampler(0.1, 1e8, 3) :
+                       HdrHistogramSampler(1, 1e6, 2);
+}
+
+template <> inline HistogramSampler make_sampler(int bins) {
+  return HistogramSampler(bins >= 200 ? 10000 : 1000, 1);
+}
+
+template <> inline AdaptiveSampler<double> make_sampler(int bins) {
+  return AdaptiveSampler<double>(100000);
+}
+
+/**
+ * s written out losslessly, for --archive and for agents to send the
+ * master, or "" if S can't be.
+ */
+template <class S> std::string serialize_sampler(S &s) { return ""; }
+
+inline std::string serialize_sampler(HdrHistogramSampler &s) {
+  return s.serialize();
+}
+
+/**
+ * Add to s what serialize_sampler() wrote for another sampler of policy
+ * S.  Returns false if S can't be read back or in isn't one.
+ */
+template <class S> bool deserialize_sampler(S &s, const char* in) {
+  return false;
+}
+
+inline bool deserialize_sampler(HdrHistogramSampler &s, const char* in) {
+  return s.deserialize(in);
+}
+
+#endif // SAMPLER_H
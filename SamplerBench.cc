@@ -0,0 +1,66 @@
+// Compare the --sampler policies: how long each takes to record a
+// sample, and how far its percentiles are from the exact ones of the
+// same samples.
+//
+//   samplerbench [samples]
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include "Sampler.h"
+#include "util.h"
+
+static const double nths[] = { 50, 90, 99, 99.9, 99.99 };
+
+/**
+ * Time sampling every value of v into s, in ns per sample.
+ */
+template <class S> double time_samples(S &s, const std::vector<double> &v) {
+  double start = get_time_accurate();
+  for (double t: v) s.sample(t);
+  return (get_time_accurate() - start) * 1e9 / v.size();
+}
+
+template <class S> void bench(const char* name,
+                              const std::vector<double> &v,
+                              const std::vector<double> &sorted) {
+  S s = make_sampler<S>(200);
+  double ns = time_samples(s, v);
+
+  printf("%-7s %9.2f", name, ns);
+  for (double nth: nths) {
+    double exact = sorted[(size_t) (sorted.size() * nth / 100)];
+    printf(" %+8.3f%%", (s.get_nth(nth) - exact) / exact * 100);
+  }
+  printf("\n");
+}
+
+int main(int argc, char **argv) {
+  size_t n = argc > 1 ? atol(argv[1]) : 5000000;
+  std::mt19937_64 rng(1);
+  // Latencies in us: a body around 150us and a long tail.
+  std::lognormal_distribution<double> latency(5.0, 1.0);
+
+  std::vector<double> v(n);
+  for (auto &t: v) t = latency(rng);
+  std::vector<double> sorted = v;
+  std::sort(sorted.begin(), sorted.end());
+
+  printf("%zu samples, percentile error against exact\n", n);
+  printf("%-7s %9s", "#type", "ns/samp");
+  for (double nth: nths) printf(" %8gth", nth);
+  printf("\n");
+
+  bench<LogHistogramSampler>("log", v, sorted);
+  bench<HdrHistogramSampler>("hdr", v, sorted);
+  bench<HistogramSampler>("linear", v, sorted);
+  bench<AdaptiveSampler<double> >("exact", v, sorted);
+
+  return 0;
+}
@@ -0,0 +1,88 @@
+// Checks on how the --sampler policies merge and travel.  Exits
+// non-zero on the first failure.
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <inttypes.h>
+#include <math.h>
+
+#include <string>
+
+#include "Sampler.h"
+
+static int failures = 0;
+
+#define CHECK(cond) do {                                           \
+    if (!(cond)) {                                                 \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__,       \
+              __LINE__, #cond);                                    \
+      failures++;                                                  \
+    }                                                              \
+  } while (0)
+
+// Two exact samplers of very different sizes, merged into a fresh one as
+// the master merges its threads: the result should count every sample
+// and weigh each side by how many it saw, not by how many it kept.
+static void test_exact_accumulate() {
+  AdaptiveSampler<double> a = make_sampler<AdaptiveSampler<double>>(200);
+  AdaptiveSampler<double> b = make_sampler<AdaptiveSampler<double>>(200);
+  AdaptiveSampler<double> all = make_sampler<AdaptiveSampler<double>>(200);
+
+  // a: 300000 uniform in [0, 100); b: 50000 uniform in [100, 200).
+  for (int i = 0; i < 300000; i++) a.sample(100 * drand48());
+  for (int i = 0; i < 50000; i++) b.sample(100 + 100 * drand48());
+
+  all.accumulate(a);
+  all.accumulate(b);
+
+  CHECK(all.total() == 350000);
+
+  // The median is the 175000th of 350000, 175000 / 300000 into a.
+  double median = all.get_nth(50);
+  printf("exact: total %" PRIu64 ", median %.2f (want 58.33)\n",
+         all.total(), median);
+  CHECK(fabs(median - 100.0 * 175000 / 300000) < 2.0);
+}
+
+// What an agent sends the master under --sampler=hdr: serialized, read
+// back into an empty histogram of the same layout, it should report the
+// same percentiles as the original.
+static void test_hdr_round_trip() {
+  HdrHistogramSampler h = make_sampler<HdrHistogramSampler>(200);
+  HdrHistogramSampler back = make_sampler<HdrHistogramSampler>(200);
+
+  // Exponential latencies around 100us, with a long tail.
+  for (int i = 0; i < 100000; i++) h.sample(-100 * log(1 - drand48()));
+
+  std::string s = serialize_sampler(h);
+  CHECK(deserialize_sampler(back, s.c_str()));
+  CHECK(back.total() == h.total());
+
+  double nths[] = { 1, 5, 10, 50, 90, 95, 99, 99.9 };
+  for (double nth: nths) {
+    printf("hdr: %5.1fth %8.2f %8.2f\n", nth, h.get_nth(nth),
+           back.get_nth(nth));
+    CHECK(back.get_nth(nth) == h.get_nth(nth));
+  }
+  CHECK(back.minimum() == h.minimum());
+  CHECK(back.maximum() == h.maximum());
+
+  // A histogram of another layout is refused, not misread.
+  HdrHistogramSampler other = make_sampler<HdrHistogramSampler>(100);
+  CHECK(!deserialize_sampler(other, s.c_str()));
+  CHECK(other.total() == 0);
+}
+
+int main(int argc, char **argv) {
+  srand48(0xdeadbeef);
+
+  test_exact_accumulate();
+  test_hdr_round_trip();
+
+  if (failures) printf("%d failed\n", failures);
+  else printf("OK\n");
+  return failures ? 1 : 0;
+}
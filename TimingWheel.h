@@ -0,0 +1,169 @@
+// -*- c++-mode -*-
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <vector>
+
+using namespace std;
+
+#define WHEEL_BITS   8
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+
+// Hierarchical timing wheel (Varghese & Lauck) with WHEEL_LEVELS levels
+// of WHEEL_SLOTS slots.  Time is counted in ticks of a fixed length; an
+// entry goes into the lowest level whose span covers its deadline and
+// is cascaded one level down each time the wheel below wraps.  insert()
+// is O(1), and advance() skips straight to occupied slots using a bitmap
+// per level, so its cost is the entries it touches plus one step per
+// non-empty slot cascaded, independent of how many are pending or how
+// far apart they are.  Entries can't
+// be cancelled; callers check on expiry whether the entry still matters.
+
+template <class T> class TimingWheel {
+public:
+  TimingWheel(double _start, double _tick) :
+    start(_start), tick(_tick), now(0), count(0) {
+    memset(counts, 0, sizeof(counts));
+    memset(occupied, 0, sizeof(occupied));
+  }
+
+  size_t size() const { return count; }
+
+  /**
+   * Time of the next tick advance() has work to do at, or 0.0 if empty.
+   * Exact when that is an expiry; otherwise a cascade, after which
+   * callers ask again.
+   */
+  double next_expiry() const {
+    if (count == 0) return 0.0;
+    return start + next_tick() * tick;
+  }
+
+  /**
+   * Schedule v to expire at the first tick at or after deadline.
+   */
+  void insert(double deadline, const T& v) {
+    uint64_t when = to_tick(deadline);
+    // The slot for the current tick has already been expired.
+    if (when <= now) when = now + 1;
+    place(when, v);
+    count++;
+  }
+
+  /**
+   * Move the wheel forward to time t, calling expire(v) for every entry
+   * whose deadline has passed.
+   */
+  template <class F> void advance(double t, F expire) {
+    uint64_t target = (uint64_t) ((t - start) / tick);
+
+    while (now < target) {
+      uint64_t next = count ? next_tick() : target + 1;
+      if (next > target) { now = target; break; }
+      now = next;
+
+      // Cascade each level whose lower levels just wrapped.
+      for (int level = 1; level < WHEEL_LEVELS; level++) {
+        if (now & (((uint64_t) 1 << (WHEEL_BITS * level)) - 1)) break;
+
+        unsigned int j = (now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        vector<entry_t> &slot = wheels[level][j];
+        occupied[level][j / 64] &= ~((uint64_t) 1 << (j % 64));
+        counts[level] -= slot.size();
+        for (size_t i = 0; i < slot.size(); i++)
+          place(slot[i].when, slot[i].value);
+        slot.clear();
+      }
+
+      unsigned int i0 = now & WHEEL_MASK;
+      vector<entry_t> &slot = wheels[0][i0];
+      occupied[0][i0 / 64] &= ~((uint64_t) 1 << (i0 % 64));
+      for (size_t i = 0; i < slot.size(); i++) {
+        count--;
+        counts[0]--;
+        expire(slot[i].value);
+      }
+      slot.clear();
+    }
+  }
+
+private:
+  typedef struct {
+    uint64_t when;
+    T        value;
+  } entry_t;
+
+  double start, tick;
+  uint64_t now; // Last tick expired.
+  size_t count;
+  size_t counts[WHEEL_LEVELS]; // Entries in each level.
+
+  vector<entry_t> wheels[WHEEL_LEVELS][WHEEL_SLOTS];
+  uint64_t occupied[WHEEL_LEVELS][WHEEL_SLOTS / 64]; // Non-empty slots.
+
+  /**
+   * The next tick after now with a level 0 slot to expire, or a
+   * non-empty slot to cascade.  A level's slots are visited in turn, one
+   * each time the levels below wrap, so the first occupied one after the
+   * current position is the next with work; empty ones are skipped.
+   */
+  uint64_t next_tick() const {
+    uint64_t next = UINT64_MAX;
+
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+      if (counts[level] == 0) continue;
+
+      int shift = WHEEL_BITS * level;
+      uint64_t from = (now >> shift) + 1;
+      uint64_t t = (from + first_occupied(level, from & WHEEL_MASK)) << shift;
+      if (t < next) next = t;
+    }
+    return next;
+  }
+
+  /**
+   * How many slots on from slot i, wrapping around, the first occupied
+   * slot of level is.
+   */
+  unsigned int first_occupied(int level, unsigned int i) const {
+    for (unsigned int d = 0; d < WHEEL_SLOTS; ) {
+      unsigned int j = (i + d) & WHEEL_MASK;
+      uint64_t w = occupied[level][j / 64] >> (j % 64);
+      if (w) return d + __builtin_ctzll(w);
+      d += 64 - j % 64;
+    }
+    return WHEEL_SLOTS; // Not reached while counts[level] > 0.
+  }
+
+  uint64_t to_tick(double t) const {
+    double ticks = (t - start) / tick;
+    uint64_t when = (uint64_t) ticks;
+    return when < ticks ? when + 1 : when;
+  }
+
+  void place(uint64_t when, const T& v) {
+    uint64_t span = (uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS);
+    // Past the top level's span: park it in the farthest slot, from
+    // where it is cascaded again.
+    uint64_t at = when - now < span ? when : now + span - 1;
+    uint64_t delta = at - now;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 &&
+           delta >= ((uint64_t) 1 << (WHEEL_BITS * (level + 1))))
+      level++;
+
+    entry_t e = { when, v };
+    unsigned int i = (at >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    wheels[level][i].push_back(e);
+    occupied[level][i / 64] |= (uint64_t) 1 << (i % 64);
+    counts[level]++;
+  }
+};
+
+#endif // TIMINGWHEEL_H
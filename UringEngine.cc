@@ -0,0 +1,512 @@
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/util.h>
+
+#include "config.h"
+
+#include "Connection.h"
+#include "log.h"
+#include "UringEngine.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#define URING_ENTRIES   4096
+#define URING_SEND_BUF  16384
+#define URING_RECV_BUFS 1024
+#define URING_RECV_BUF  4096
+#define URING_BGID      0
+
+#define URING_CONNECT 1
+#define URING_RECV    2
+#define URING_SEND    3
+#define URING_TIMEOUT 4
+
+#define URING_DATA(slot, kind) (((uint64_t) (slot) << 8) | (kind))
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+  return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags) {
+  return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                       flags, NULL, 0);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg,
+                          unsigned nr_args) {
+  return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * Check whether the running kernel lets us create an io_uring.
+ */
+bool UringEngine::supported() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = uring_setup(2, &p);
+  if (fd < 0) return false;
+  close(fd);
+  return (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+}
+
+/**
+ * Create the ring, the registered file table, the registered send
+ * buffers and the provided receive buffer ring for up to _slots
+ * server connections.
+ */
+UringEngine::UringEngine(struct event_base* _base, int _slots) :
+  base(_base), sqe_tail(0), sqe_submitted(0), slots(_slots), slots_used(0),
+  buf_ring_tail(0)
+{
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+
+  if ((ring_fd = uring_setup(URING_ENTRIES, &p)) < 0)
+    DIE("io_uring_setup() failed: %s", strerror(errno));
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP))
+    DIE("io_uring: kernel lacks IORING_FEAT_SINGLE_MMAP");
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (cq_size > sq_size) sq_size = cq_size;
+  cq_size = sq_size;
+
+  sq_ptr = mmap(0, sq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ptr == MAP_FAILED) DIE("io_uring: mmap(SQ ring) failed");
+  cq_ptr = sq_ptr;
+
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = (struct io_uring_sqe *)
+    mmap(0, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+         ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) DIE("io_uring: mmap(SQEs) failed");
+
+  sq_entries = p.sq_entries;
+  sq_head  = (unsigned *) ((char *) sq_ptr + p.sq_off.head);
+  sq_tail  = (unsigned *) ((char *) sq_ptr + p.sq_off.tail);
+  sq_mask  = (unsigned *) ((char *) sq_ptr + p.sq_off.ring_mask);
+  sq_array = (unsigned *) ((char *) sq_ptr + p.sq_off.array);
+  cq_head  = (unsigned *) ((char *) cq_ptr + p.cq_off.head);
+  cq_tail  = (unsigned *) ((char *) cq_ptr + p.cq_off.tail);
+  cq_mask  = (unsigned *) ((char *) cq_ptr + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *) ((char *) cq_ptr + p.cq_off.cqes);
+  sqe_tail = sqe_submitted = *sq_tail;
+
+  // Sparse registered file table, filled in as sockets are created.
+  vector<int> fds(slots.size(), -1);
+  fixed_files = uring_register(ring_fd, IORING_REGISTER_FILES,
+                               fds.data(), fds.size()) == 0;
+  if (!fixed_files) V("io_uring: registered files unavailable: %s",
+                      strerror(errno));
+
+  // One registered region carved into a send buffer per slot.
+  size_t send_size = slots.size() * URING_SEND_BUF;
+  send_region = (char *) mmap(0, send_size, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (send_region == MAP_FAILED) DIE("io_uring: mmap(send buffers) failed");
+
+  struct iovec iov = { send_region, send_size };
+  fixed_bufs = uring_register(ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+  if (!fixed_bufs) V("io_uring: registered buffers unavailable: %s",
+                     strerror(errno));
+
+  for (size_t i = 0; i < slots.size(); i++) {
+    slots[i].engine   = this;
+    slots[i].id       = i;
+    slots[i].serv     = NULL;
+    slots[i].fd       = -1;
+    slots[i].send_buf = send_region + i * URING_SEND_BUF;
+    slots[i].send_off = slots[i].send_len = 0;
+    slots[i].dirty    = false;
+  }
+
+  // Provided buffer ring shared by every multishot recv on this thread.
+  buf_ring_size = URING_RECV_BUFS * sizeof(struct io_uring_buf);
+  buf_ring = (struct io_uring_buf_ring *)
+    mmap(0, buf_ring_size, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  recv_region = (char *) mmap(0, URING_RECV_BUFS * URING_RECV_BUF,
+                              PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf_ring == MAP_FAILED || recv_region == MAP_FAILED)
+    DIE("io_uring: mmap(receive buffers) failed");
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr    = (uint64_t) buf_ring;
+  reg.ring_entries = URING_RECV_BUFS;
+  reg.bgid         = URING_BGID;
+  if (uring_register(ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1))
+    DIE("io_uring: IORING_REGISTER_PBUF_RING failed: %s", strerror(errno));
+
+  for (unsigned short b = 0; b < URING_RECV_BUFS; b++) recycle_buffer(b);
+
+  ring_event = event_new(base, ring_fd, EV_READ | EV_PERSIST, uring_cb, this);
+  event_add(ring_event, NULL);
+}
+
+/**
+ * Tear down the ring.  Connections must already have been freed.
+ */
+UringEngine::~UringEngine() {
+  event_free(ring_event);
+  close(ring_fd);
+
+  munmap(recv_region, URING_RECV_BUFS * URING_RECV_BUF);
+  munmap(buf_ring, buf_ring_size);
+  munmap(send_region, slots.size() * URING_SEND_BUF);
+  munmap(sqes, sqes_size);
+  munmap(sq_ptr, sq_size);
+}
+
+/**
+ * Create the socket and the (disabled) bufferevent for a server.  The
+ * bufferevent only serves as a pair of evbuffers for the Protocol; the
+ * Connection sets its callbacks.
+ */
+struct bufferevent* UringEngine::new_bufferevent(server_t &serv) {
+  if (slots_used >= (int) slots.size())
+    DIE("io_uring: more server connections than slots (%zu)", slots.size());
+
+  slot_t &slot = slots[slots_used++];
+  memset(&slot.addr, 0, sizeof(slot.addr));
+
+  if (serv.unix_socket) {
+    struct sockaddr_un *sun = (struct sockaddr_un *) &slot.addr;
+    sun->sun_family = AF_UNIX;
+    strcpy(sun->sun_path, serv.host.c_str());
+    slot.addr_len = sizeof(struct sockaddr_un);
+  } else {
+    struct evutil_addrinfo hints, *answer = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags    = EVUTIL_AI_NUMERICHOST;
+
+    int err = evutil_getaddrinfo(serv.host.c_str(), serv.port.c_str(),
+                                 &hints, &answer);
+    if (err || answer == NULL)
+      DIE("io_uring: bad address %s:%s", serv.host.c_str(), serv.port.c_str());
+
+    memcpy(&slot.addr, answer->ai_addr, answer->ai_addrlen);
+    slot.addr_len = answer->ai_addrlen;
+    evutil_freeaddrinfo(answer);
+  }
+
+  slot.fd = socket(slot.addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (slot.fd < 0) DIE("socket() failed: %s", strerror(errno));
+  evutil_make_socket_nonblocking(slot.fd);
+
+  if (fixed_files) {
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = slot.id;
+    up.fds = (uint64_t) &slot.fd;
+    if (uring_register(ring_fd, IORING_REGISTER_FILES_UPDATE, &up, 1) != 1)
+      DIE("io_uring: IORING_REGISTER_FILES_UPDATE failed: %s",
+          strerror(errno));
+  }
+
+  struct bufferevent *bev =
+    bufferevent_socket_new(base, slot.fd, BEV_OPT_CLOSE_ON_FREE);
+  bufferevent_disable(bev, EV_READ | EV_WRITE);
+
+  // bufferevent_socket_new() freezes the ends it does I/O on itself;
+  // here that is our job.
+  evbuffer_unfreeze(bufferevent_get_input(bev), 0);
+  evbuffer_unfreeze(bufferevent_get_output(bev), 1);
+  evbuffer_add_cb(bufferevent_get_output(bev), uring_output_cb, &slot);
+
+  slot.serv = &serv;
+  serv.uring_slot = slot.id;
+  return bev;
+}
+
+/**
+ * Queue an asynchronous connect for a server, linked to a timeout if one
+ * is given.
+ */
+void UringEngine::connect(server_t &serv, double timeout) {
+  slot_t &slot = slots[serv.uring_slot];
+
+  // A link must not straddle two io_uring_enter() calls.
+  if (timeout > 0 &&
+      sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) + 2 > sq_entries)
+    submit();
+
+  struct io_uring_sqe *sqe = get_sqe();
+
+  sqe->opcode = IORING_OP_CONNECT;
+  prep_fd(sqe, slot.id);
+  sqe->addr = (uint64_t) &slot.addr;
+  sqe->off  = slot.addr_len;
+  sqe->user_data = URING_DATA(slot.id, URING_CONNECT);
+
+  if (timeout > 0) {
+    sqe->flags |= IOSQE_IO_LINK;
+
+    slot.connect_timeout.tv_sec  = (long long) timeout;
+    slot.connect_timeout.tv_nsec =
+      (long long) ((timeout - (long long) timeout) * 1000000000);
+
+    sqe = get_sqe();
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) &slot.connect_timeout;
+    sqe->len = 1;
+    sqe->user_data = URING_DATA(slot.id, URING_TIMEOUT);
+  }
+}
+
+/**
+ * Start sends for every slot whose output grew, then hand all queued
+ * SQEs to the kernel with a single io_uring_enter().
+ */
+void UringEngine::submit() {
+  for (int i: dirty) {
+    slots[i].dirty = false;
+    if (slots[i].send_len == 0) send(i);
+  }
+  dirty.clear();
+
+  unsigned int n = sqe_tail - sqe_submitted;
+  if (n == 0) return;
+
+  __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+  while (n > 0) {
+    int ret = uring_enter(ring_fd, n, 0, 0);
+    if (ret < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+      DIE("io_uring_enter() failed: %s", strerror(errno));
+    }
+    n -= ret;
+    sqe_submitted += ret;
+  }
+}
+
+/**
+ * Reap every available completion and dispatch it to its Connection.
+ */
+void UringEngine::completion_callback() {
+  unsigned head = *cq_head;
+
+  while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe cqe = cqes[head & *cq_mask];
+    head++;
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+
+    int id = cqe.user_data >> 8;
+    slot_t &slot = slots[id];
+    server_t *serv = slot.serv;
+    if (serv == NULL) continue;
+
+    switch (cqe.user_data & 0xff) {
+    case URING_CONNECT:
+      if (cqe.res == -ECANCELED) {
+        fail(id, BEV_EVENT_TIMEOUT, ETIMEDOUT);
+        break;
+      }
+      if (cqe.res < 0) { fail(id, BEV_EVENT_ERROR, -cqe.res); break; }
+      serv->conn->event_callback(serv, BEV_EVENT_CONNECTED);
+      arm_recv(id);
+      break;
+
+    case URING_RECV:
+      if (cqe.flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe.res > 0)
+          evbuffer_add(bufferevent_get_input(serv->bev),
+                       recv_region + bid * URING_RECV_BUF, cqe.res);
+        recycle_buffer(bid);
+      }
+
+      if (cqe.res == 0) { fail(id, BEV_EVENT_EOF, 0); break; }
+      if (cqe.res < 0 && cqe.res != -ENOBUFS) {
+        fail(id, BEV_EVENT_ERROR, -cqe.res);
+        break;
+      }
+      if (!(cqe.flags & IORING_CQE_F_MORE)) rearm.push_back(id);
+      if (cqe.res > 0) serv->conn->read_callback(serv);
+      break;
+
+    case URING_TIMEOUT:
+      break;
+
+    case URING_SEND:
+      if (cqe.res < 0) { fail(id, BEV_EVENT_ERROR, -cqe.res); break; }
+      slot.send_off += cqe.res;
+      if (slot.send_off < slot.send_len) {
+        send(id);
+      } else {
+        slot.send_off = slot.send_len = 0;
+        send(id);
+      }
+      break;
+
+    default: DIE("io_uring: unknown completion %llu",
+                 (unsigned long long) cqe.user_data);
+    }
+  }
+
+  for (int id: rearm) arm_recv(id);
+  rearm.clear();
+  submit();
+}
+
+/**
+ * Note that a slot's output evbuffer gained data.
+ */
+void UringEngine::output_callback(int id) {
+  if (slots[id].dirty) return;
+  slots[id].dirty = true;
+  dirty.push_back(id);
+}
+
+/**
+ * Get a free SQE, flushing the submission queue if it is full.
+ */
+struct io_uring_sqe* UringEngine::get_sqe() {
+  if (sqe_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries) {
+    __atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+    int ret = uring_enter(ring_fd, sqe_tail - sqe_submitted, 0, 0);
+    if (ret < 0) DIE("io_uring_enter() failed: %s", strerror(errno));
+    sqe_submitted += ret;
+  }
+
+  unsigned idx = sqe_tail & *sq_mask;
+  struct io_uring_sqe *sqe = &sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array[idx] = idx;
+  sqe_tail++;
+  return sqe;
+}
+
+/**
+ * Point an SQE at a slot's socket, via the registered file table if
+ * we have one.
+ */
+void UringEngine::prep_fd(struct io_uring_sqe *sqe, int id) {
+  if (fixed_files) {
+    sqe->fd = id;
+    sqe->flags |= IOSQE_FIXED_FILE;
+  } else {
+    sqe->fd = slots[id].fd;
+  }
+}
+
+/**
+ * Arm a multishot recv that selects buffers from the provided ring.
+ */
+void UringEngine::arm_recv(int id) {
+  struct io_uring_sqe *sqe = get_sqe();
+
+  sqe->opcode = IORING_OP_RECV;
+  prep_fd(sqe, id);
+  sqe->flags |= IOSQE_BUFFER_SELECT;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->buf_group = URING_BGID;
+  sqe->user_data = URING_DATA(id, URING_RECV);
+}
+
+/**
+ * Send the rest of the slot's send buffer, or refill it from the
+ * output evbuffer.
+ */
+void UringEngine::send(int id) {
+  slot_t &slot = slots[id];
+
+  if (slot.send_len == 0) {
+    struct evbuffer *output = bufferevent_get_output(slot.serv->bev);
+    if (evbuffer_get_length(output) == 0) return;
+
+    int n = evbuffer_remove(output, slot.send_buf, URING_SEND_BUF);
+    if (n <= 0) return;
+    slot.send_off = 0;
+    slot.send_len = n;
+  }
+
+  struct io_uring_sqe *sqe = get_sqe();
+  prep_fd(sqe, id);
+  sqe->addr = (uint64_t) (slot.send_buf + slot.send_off);
+  sqe->len  = slot.send_len - slot.send_off;
+  sqe->user_data = URING_DATA(id, URING_SEND);
+
+  if (fixed_bufs) {
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->off = (uint64_t) -1;
+    sqe->buf_index = 0;
+  } else {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->msg_flags = MSG_NOSIGNAL;
+  }
+}
+
+/**
+ * Return a receive buffer to the provided buffer ring.
+ */
+void UringEngine::recycle_buffer(unsigned short bid) {
+  // Index from the ring base rather than through buf_ring->bufs: the
+  // kernel header's flexible array member is not at offset 0 in C++.
+  struct io_uring_buf *buf = (struct io_uring_buf *) buf_ring +
+    (buf_ring_tail & (URING_RECV_BUFS - 1));
+  buf->addr = (uint64_t) (recv_region + bid * URING_RECV_BUF);
+  buf->len  = URING_RECV_BUF;
+  buf->bid  = bid;
+  buf_ring_tail++;
+  __atomic_store_n(&buf_ring->tail, buf_ring_tail, __ATOMIC_RELEASE);
+}
+
+/**
+ * Report a connection error or EOF to the owning Connection.
+ */
+void UringEngine::fail(int id, short events, int err) {
+  server_t *serv = slots[id].serv;
+  errno = err;
+  serv->conn->event_callback(serv, events);
+}
+
+#else // !HAVE_LINUX_IO_URING_H
+
+bool UringEngine::supported() { return false; }
+UringEngine::UringEngine(struct event_base* _base, int _slots) {
+  DIE("io_uring support not compiled in");
+}
+UringEngine::~UringEngine() {}
+struct bufferevent* UringEngine::new_bufferevent(server_t &serv) {
+  return NULL;
+}
+void UringEngine::connect(server_t &serv, double timeout) {}
+void UringEngine::submit() {}
+void UringEngine::completion_callback() {}
+void UringEngine::output_callback(int slot) {}
+
+#endif // HAVE_LINUX_IO_URING_H
+
+/* The follow are C trampolines for libevent callbacks. */
+void uring_cb(evutil_socket_t fd, short what, void *ptr) {
+  UringEngine* engine = (UringEngine*) ptr;
+  loop_events++;
+  engine->completion_callback();
+}
+
+void uring_output_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info,
+                     void *ptr) {
+#ifdef HAVE_LINUX_IO_URING_H
+  if (info->n_added == 0) return;
+  UringEngine::slot_t *slot = (UringEngine::slot_t *) ptr;
+  slot->engine->output_callback(slot->id);
+#endif
+}
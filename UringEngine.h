@@ -0,0 +1,103 @@
+// -*- c++-mode -*-
+#ifndef URINGENGINE_H
+#define URINGENGINE_H
+
+#include <sys/socket.h>
+
+#include <vector>
+
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+
+#include "config.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#endif
+
+#include "Connection.h"
+
+using namespace std;
+
+// Alternative socket I/O engine for one do_mutilate() thread.  Every
+// server_t keeps its bufferevent so the Connection state machines and
+// Protocol parsers still work on evbuffers, but the bufferevent is left
+// disabled: responses arrive through a multishot recv into a provided
+// buffer ring, and requests are copied from the output evbuffer into
+// registered buffers and written with one batched io_uring_enter() per
+// event loop iteration.  The ring fd itself is registered with the
+// event_base so libevent timers keep driving the write machines.
+
+class UringEngine {
+public:
+  UringEngine(struct event_base* _base, int _slots);
+  ~UringEngine();
+
+  static bool supported();
+
+  struct bufferevent* new_bufferevent(server_t &serv);
+  void connect(server_t &serv, double timeout = 0.0);
+  void submit();
+
+  // event callbacks
+  void completion_callback();
+  void output_callback(int slot);
+
+private:
+#ifdef HAVE_LINUX_IO_URING_H
+  typedef struct {
+    UringEngine*            engine;
+    int                     id;
+    server_t*               serv;
+    int                     fd;
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+    struct __kernel_timespec connect_timeout;
+    char*                   send_buf;
+    unsigned int            send_off, send_len;
+    bool                    dirty;
+  } slot_t;
+
+  struct event_base *base;
+  struct event *ring_event;
+
+  int ring_fd;
+  unsigned int sq_entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ptr, *cq_ptr;
+  size_t sq_size, cq_size, sqes_size;
+  unsigned int sqe_tail, sqe_submitted;
+
+  vector<slot_t> slots;
+  int slots_used;
+  bool fixed_files, fixed_bufs;
+  char *send_region;
+
+  struct io_uring_buf_ring *buf_ring;
+  char *recv_region;
+  size_t buf_ring_size;
+  unsigned short buf_ring_tail;
+
+  vector<int> dirty, rearm;
+
+  struct io_uring_sqe* get_sqe();
+  void prep_fd(struct io_uring_sqe *sqe, int slot);
+  void arm_recv(int slot);
+  void send(int slot);
+  void recycle_buffer(unsigned short bid);
+  void fail(int slot, short events, int err);
+
+  friend void uring_output_cb(struct evbuffer *buf,
+                              const struct evbuffer_cb_info *info, void *ptr);
+#endif
+};
+
+void uring_cb(evutil_socket_t fd, short what, void *ptr);
+void uring_output_cb(struct evbuffer *buf, const struct evbuffer_cb_info *info,
+                     void *ptr);
+
+#endif // URINGENGINE_H
@@ -1,14 +1,19 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <deque>
 #include <queue>
 #include <string>
 #include <vector>
@@ -26,6 +31,10 @@
 #include <zmq.hpp>
 #endif
 
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
 #include "AdaptiveSampler.h"
 #include "AgentStats.h"
 #ifndef HAVE_PTHREAD_BARRIER_INIT
@@ -34,8 +43,10 @@
 #include "cmdline.h"
 #include "Connection.h"
 #include "ConnectionOptions.h"
+#include "IntervalStats.h"
 #include "log.h"
 #include "mutilate.h"
+#include "UringEngine.h"
 #include "util.h"
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
@@ -65,23 +76,47 @@ pthread_barrier_t barrier;
 
 double boot_time;
 
+// --report: one IntervalBuffer per thread, taken as the threads start.
+template <class S> vector<IntervalBuffer<S>*>& report_buffers() {
+  static vector<IntervalBuffer<S>*> buffers;
+  return buffers;
+}
+atomic<size_t> report_joined;
+
 void init_random_stuff();
 
-void go(const vector<string> &servers, options_t &options,
-        ConnectionStats &stats
+// Everything that touches a sampler comes in one instance per --sampler
+// policy S; main() and agent() pick one.
+template <class S> void run(const vector<string> &servers,
+                            options_t &options);
+
+template <class S> void go(const vector<string> &servers, options_t &options,
+                           BasicConnectionStats<S> &stats
 #ifdef HAVE_LIBZMQ
 , zmq::socket_t* socket = NULL
 #endif
 );
 
+template <class S>
 void do_mutilate(const vector<string> &servers, options_t &options,
-                 ConnectionStats &stats, bool master = true
+                 BasicConnectionStats<S> &stats, bool master = true
 #ifdef HAVE_LIBZMQ
 , zmq::socket_t* socket = NULL
 #endif
 );
 void args_to_options(options_t* options);
-void* thread_main(void *arg);
+template <class S> void* thread_main(void *arg);
+template <class S> void* report_main(void *arg);
+template <class S> void loop_once(thread_state_t<S>* ts, int flags);
+template <class S> void free_thread_state(thread_state_t<S>* ts);
+void raise_fd_limit(rlim_t want);
+template <class S>
+void loop_timed(thread_state_t<S>* ts, int flags, options_t& options,
+                double& spin, double& sleep, double& last_event);
+#ifdef HAVE_LIBNUMA
+vector<cpu_set_t> numa_node_cpus();
+const char* numa_values(int node);
+#endif
 
 #ifdef HAVE_LIBZMQ
 static std::string s_recv (zmq::socket_t &socket) {
@@ -99,6 +134,39 @@ static bool s_send (zmq::socket_t &socket, const std::string &string) {
   return socket.send(message);
 }
 
+/**
+ * Run one measurement for the master, sampling with policy S, and send
+ * it our AgentStats, then our get and set samplers if S serializes.
+ */
+template <class S>
+void agent_run(const vector<string>& servers, options_t& options,
+               zmq::socket_t& socket) {
+  BasicConnectionStats<S> stats;
+
+  go(servers, options, stats, &socket);
+
+  AgentStats as;
+
+  as.rx_bytes = stats.rx_bytes;
+  as.tx_bytes = stats.tx_bytes;
+  as.gets = stats.gets;
+  as.sets = stats.sets;
+  as.get_misses = stats.get_misses;
+  as.start = stats.start;
+  as.stop = stats.stop;
+  as.skips = stats.skips;
+
+  string req = s_recv(socket);
+  //    V("req = %s", req.c_str());
+  zmq::message_t reply(sizeof(as));
+  memcpy(reply.data(), &as, sizeof(as));
+  socket.send(reply);
+
+  req = s_recv(socket);
+  s_send(socket, serialize_sampler(stats.get_sampler) + "\n" +
+                 serialize_sampler(stats.set_sampler));
+}
+
 /*
  * Agent protocol
  *
@@ -148,9 +216,13 @@ static bool s_send (zmq::socket_t &socket, const std::string &string) {
  * 2. Everyone: RUN for options.time seconds.
  * 3. Master -> Agent: Dummy message
  * 4. Agent -> Master: Send AgentStats [w/ RX/TX bytes, # gets/sets]
+ * 5. Master -> Agent: Dummy message
+ * 6. Agent -> Master: get and set samplers, serialized [--sampler=hdr]
  *
  * The master then aggregates AgentStats across all agents with its
- * own ConnectionStats to compute overall statistics.
+ * own ConnectionStats to compute overall statistics.  Under
+ * --sampler=hdr it merges the agents' histograms into its own too, so
+ * the latencies it reports cover every agent, not just itself.
  */
 
 void agent() {
@@ -197,33 +269,28 @@ void agent() {
     //    if (options.threads > 1)
       pthread_barrier_init(&barrier, NULL, options.threads);
 
-    ConnectionStats stats;
-
-    go(servers, options, stats, &socket);
-
-    AgentStats as;
-
-    as.rx_bytes = stats.rx_bytes;
-    as.tx_bytes = stats.tx_bytes;
-    as.gets = stats.gets;
-    as.sets = stats.sets;
-    as.get_misses = stats.get_misses;
-    as.start = stats.start;
-    as.stop = stats.stop;
-    as.skips = stats.skips;
-
-    string req = s_recv(socket);
-    //    V("req = %s", req.c_str());
-    request.rebuild(sizeof(as));
-    memcpy(request.data(), &as, sizeof(as));
-    socket.send(request);
+    // Sample as the master does, so what we send back merges.
+    switch (options.sampler) {
+    case SAMPLER_HDR:
+      agent_run<HdrHistogramSampler>(servers, options, socket);
+      break;
+    case SAMPLER_LINEAR:
+      agent_run<HistogramSampler>(servers, options, socket);
+      break;
+    case SAMPLER_EXACT:
+      agent_run<AdaptiveSampler<double> >(servers, options, socket);
+      break;
+    default:
+      agent_run<LogHistogramSampler>(servers, options, socket);
+    }
   }
 }
 
 void prep_agent(const vector<string>& servers, options_t& options) {
   int sum = options.lambda_denom;
   if (args.measure_connections_given)
-    sum = args.measure_connections_arg * options.server_given * options.threads;
+    sum = args.measure_connections_arg * options.threads *
+      (options.ketama ? 1 : options.server_given);
 
   int master_sum = sum;
   if (args.measure_qps_given) {
@@ -243,7 +310,7 @@ void prep_agent(const vector<string>& servers, options_t& options) {
 
     sum += options.connections * (options.roundrobin ?
             (servers.size() > num ? servers.size() : num) : 
-            (servers.size() * num));
+            options.ketama ? num : (servers.size() * num));
 
     for (auto i: servers) {
       s_send(*s, i);
@@ -284,7 +351,7 @@ void prep_agent(const vector<string>& servers, options_t& options) {
   V("MASTER SLEEPS"); sleep_time(1.5);
 }
 
-void finish_agent(ConnectionStats &stats) {
+template <class S> void finish_agent(BasicConnectionStats<S> &stats) {
   for (auto s: agent_sockets) {
     s_send(*s, "stats");
 
@@ -294,6 +361,18 @@ void finish_agent(ConnectionStats &stats) {
     s->recv(&message);
     memcpy(&as, message.data(), sizeof(as));
     stats.accumulate(as);
+
+    // Latencies, when S can send them ("" otherwise): get, '\n', set.
+    s_send(*s, "samplers");
+    string rep = s_recv(*s);
+    size_t nl = rep.find('\n');
+    if (nl == string::npos) DIE("finish_agent: bad samplers reply");
+
+    string get = rep.substr(0, nl), set = rep.substr(nl + 1);
+    if (get.empty() && set.empty()) continue;
+    if (!deserialize_sampler(stats.get_sampler, get.c_str()) ||
+        !deserialize_sampler(stats.set_sampler, set.c_str()))
+      W("Agent latencies don't match our --sampler, left out.");
   }
 }
 
@@ -371,6 +450,97 @@ int main(int argc, char **argv) {
     DIE("--connections must be between [1,%d]", MAXIMUM_CONNECTIONS);
   if (!args.server_given && !args.agentmode_given)
     DIE("--server or --agentmode must be specified.");
+  if (args.io_uring_given && !UringEngine::supported())
+    DIE("--io_uring is not supported by this build or kernel.");
+  if (args.churn_given && args.churn_arg < 1) DIE("--churn must be >= 1");
+  if (args.churn_requests_arg < 1) DIE("--churn_requests must be >= 1");
+  if (args.connect_parallel_arg < 0) DIE("--connect_parallel must be >= 0");
+  if (args.connect_timeout_arg < 0) DIE("--connect_timeout must be >= 0");
+  if (args.churn_given && args.io_uring_given)
+    DIE("--churn is not supported with --io_uring.");
+  if (args.reconnect_given && args.io_uring_given)
+    DIE("--reconnect is not supported with --io_uring.");
+  if (args.backoff_min_arg <= 0 || args.backoff_max_arg < args.backoff_min_arg)
+    DIE("--backoff_min must be > 0 and <= --backoff_max");
+  if (args.op_timeout_given && args.op_timeout_arg < 1)
+    DIE("--op_timeout must be >= 1");
+  if (args.op_timeout_given && !args.timeout_wait_given && args.io_uring_given)
+    DIE("--op_timeout without --timeout_wait is not supported with --io_uring.");
+#ifndef HAVE_LINUX_NET_TSTAMP_H
+  if (args.timestamping_given)
+    DIE("--timestamping is not supported by this build.");
+#endif
+  if (args.timestamping_given && args.io_uring_given)
+    DIE("--timestamping is not supported with --io_uring.");
+  if (args.open_loop_given) {
+    if (strcmp(args.open_loop_arg, "queue") && strcmp(args.open_loop_arg, "drop") &&
+        strcmp(args.open_loop_arg, "spill"))
+      DIE("--open_loop must be queue, drop or spill");
+    if (args.qps_arg < 1) DIE("--open_loop needs --qps");
+    if (args.skip_given) DIE("--open_loop and --skip are exclusive");
+  }
+  if (args.ketama_given) {
+    if (args.roundrobin_given) DIE("--ketama and --roundrobin are exclusive");
+    for (unsigned int s = 0; s < args.server_given; s++)
+      if (strchr(args.server_arg[s], '|'))
+        DIE("--ketama servers can't be grouped with '|': %s",
+            args.server_arg[s]);
+  }
+  if (args.replicate_given) {
+    if (strcmp(args.replicate_arg, "first") &&
+        strcmp(args.replicate_arg, "quorum") && strcmp(args.replicate_arg, "all"))
+      DIE("--replicate must be first, quorum or all");
+    if (args.ketama_given) DIE("--replicate and --ketama are exclusive");
+    if (args.etcd_given || args.http_given)
+      DIE("--replicate is not supported with --etcd or --http.");
+  }
+  if (args.read_replica_arg < 0) DIE("--read_replica must be >= 0");
+  if (args.hedge_given) {
+    const char *d = args.hedge_arg[0] == 'p' ? args.hedge_arg + 1 : args.hedge_arg;
+    if (atof(d) <= 0 || (args.hedge_arg[0] == 'p' && atof(d) >= 100))
+      DIE("--hedge must be a delay in us > 0, or pN with 0 < N < 100");
+    if (args.ketama_given) DIE("--hedge and --ketama are exclusive");
+    if (args.etcd_given || args.http_given)
+      DIE("--hedge is not supported with --etcd or --http.");
+  }
+  if (args.rebalance_given) {
+    if (args.rebalance_arg <= 0) DIE("--rebalance must be > 0");
+    if (args.io_uring_given)
+      DIE("--rebalance is not supported with --io_uring.");
+    if (args.timestamping_given)
+      DIE("--rebalance is not supported with --timestamping.");
+  }
+#ifdef HAVE_LIBNUMA
+  if (args.numa_given && numa_available() < 0)
+    DIE("--numa: NUMA is not available on this system.");
+#else
+  if (args.numa_given) DIE("--numa is not supported by this build.");
+#endif
+  if (args.measure_threads_given) {
+    if (args.measure_threads_arg < 1) DIE("--measure_threads must be >= 1");
+    if (!args.measure_qps_given || args.measure_qps_arg < 1)
+      DIE("--measure_threads needs --measure_qps to set the probe rate.");
+    if (args.agent_given || args.agentmode_given)
+      DIE("--measure_threads replaces --agent; use one or the other.");
+  }
+  if (args.report_given && args.report_arg <= 0)
+    DIE("--report must be > 0");
+  if (strcmp(args.sampler_arg, "log") && strcmp(args.sampler_arg, "hdr") &&
+      strcmp(args.sampler_arg, "linear") && strcmp(args.sampler_arg, "exact"))
+    DIE("--sampler must be log, hdr, linear or exact");
+  if (args.cache_aside_given) {
+    if (args.replicate_given || args.hedge_given)
+      DIE("--cache_aside is not supported with --replicate or --hedge.");
+    if (args.etcd_given || args.http_given)
+      DIE("--cache_aside is not supported with --etcd or --http.");
+  }
+  if (args.numa_incoming_given) {
+    if (!args.numa_given) DIE("--numa_incoming requires --numa");
+    if (args.io_uring_given)
+      DIE("--numa_incoming is not supported with --io_uring.");
+    if (args.timestamping_given)
+      DIE("--numa_incoming is not supported with --timestamping.");
+  }
 
   // TODO: Discover peers, share arguments.
 
@@ -378,6 +548,10 @@ int main(int argc, char **argv) {
   boot_time = get_time();
   setvbuf(stdout, NULL, _IONBF, 0);
 
+  // A write to a server that just went away must fail, not kill us.
+  // --io_uring's IORING_OP_WRITE_FIXED sends can't carry MSG_NOSIGNAL.
+  if (args.reconnect_given || args.io_uring_given) signal(SIGPIPE, SIG_IGN);
+
 #ifdef HAVE_LIBZMQ
   if (args.agentmode_given) {
     agent();
@@ -396,14 +570,43 @@ int main(int argc, char **argv) {
   options_t options;
   args_to_options(&options);
 
-  pthread_barrier_init(&barrier, NULL, options.threads);
+  pthread_barrier_init(&barrier, NULL,
+                       options.threads + options.measure_threads);
 
   vector<string> servers;
   for (unsigned int s = 0; s < args.server_given; s++) {
     servers.push_back(args.server_arg[s]);
   }
 
-  ConnectionStats stats;
+  switch (options.sampler) {
+  case SAMPLER_HDR:    run<HdrHistogramSampler>(servers, options); break;
+  case SAMPLER_LINEAR: run<HistogramSampler>(servers, options); break;
+  case SAMPLER_EXACT:  run<AdaptiveSampler<double> >(servers, options); break;
+  default:             run<LogHistogramSampler>(servers, options);
+  }
+
+  //  if (args.threads_arg > 1) 
+    pthread_barrier_destroy(&barrier);
+
+#ifdef HAVE_LIBZMQ
+  if (args.agent_given) {
+    for (auto i: agent_sockets) delete i;
+  }
+#endif
+
+  // evdns_base_free(evdns, 0);
+  // event_base_free(base);
+
+  cmdline_parser_free(&args);
+}
+
+/**
+ * Run the benchmark --search, --scan or plain options ask for, sampling
+ * with policy S, and print the results.
+ */
+template <class S> void run(const vector<string> &servers,
+                            options_t &options) {
+  BasicConnectionStats<S> stats;
 
   double peak_qps = 0.0;
 
@@ -442,7 +645,7 @@ int main(int argc, char **argv) {
       options.qps = cur_qps;
       options.lambda = (double) options.qps / (double) options.lambda_denom * args.lambda_mul_arg;
 
-      stats = ConnectionStats();
+      stats = BasicConnectionStats<S>();
 
       go(servers, options, stats);
 
@@ -464,7 +667,7 @@ int main(int argc, char **argv) {
       options.qps = cur_qps;
       options.lambda = (double) options.qps / (double) options.lambda_denom * args.lambda_mul_arg;
 
-      stats = ConnectionStats();
+      stats = BasicConnectionStats<S>();
 
       go(servers, options, stats);
 
@@ -499,7 +702,7 @@ int main(int argc, char **argv) {
       //        args.server_given /
       //        (args.threads_arg < 1 ? 1 : args.threads_arg);
 
-      stats = ConnectionStats();
+      stats = BasicConnectionStats<S>();
 
       go(servers, options, stats);
 
@@ -564,6 +767,34 @@ int main(int argc, char **argv) {
       fprintf(arch, "Load pause: %d\n", options.lpause);
       fprintf(arch, "Lambda: %f\n", options.lambda);
       fprintf(arch, "Blocking: %d\n", options.blocking);
+      fprintf(arch, "io_uring: %d\n", options.io_uring);
+      fprintf(arch, "Spin: %d\n", options.spin);
+      fprintf(arch, "Busy poll: %d\n", options.busy_poll);
+      fprintf(arch, "Cork: %d\n", options.cork);
+      fprintf(arch, "Churn: %f\n", options.churn);
+      fprintf(arch, "Churn requests: %d\n", options.churn_requests);
+      fprintf(arch, "Connect parallel: %d\n", options.connect_parallel);
+      fprintf(arch, "Connect timeout: %f\n", options.connect_timeout);
+      fprintf(arch, "Reconnect: %d\n", options.reconnect);
+      fprintf(arch, "Backoff: %f - %f\n", options.backoff_min,
+              options.backoff_max);
+      fprintf(arch, "Op timeout: %d\n", options.op_timeout);
+      fprintf(arch, "Timeout wait: %d\n", options.timeout_wait);
+      fprintf(arch, "Timestamping: %d\n", options.timestamping);
+      fprintf(arch, "Open loop: %d\n", options.open_loop);
+      fprintf(arch, "Ketama: %d\n", options.ketama);
+      fprintf(arch, "Replicate: %d\n", options.replicate);
+      fprintf(arch, "Read replica: %d\n", options.read_replica);
+      fprintf(arch, "Hedge: %d (%f us, p%f)\n", options.hedge,
+              options.hedge_delay, options.hedge_nth);
+      fprintf(arch, "Rebalance: %f\n", options.rebalance);
+      fprintf(arch, "NUMA: %d (incoming %d)\n", options.numa,
+              options.numa_incoming);
+      fprintf(arch, "Report: %f\n", options.report);
+      fprintf(arch, "Measure threads: %d\n", options.measure_threads);
+      fprintf(arch, "Cache aside: %d (%s)\n", options.cache_aside,
+              options.backend);
+      fprintf(arch, "Sampler: %s\n", args.sampler_arg);
       fprintf(arch, "No delay: %d\n", !options.no_nodelay);
       fprintf(arch, "Round robbin: %d\n", options.roundrobin);
       fprintf(arch, "Moderate: %d\n", options.moderate);
@@ -576,6 +807,31 @@ int main(int argc, char **argv) {
     stats.print_stats(arch, "read",   stats.get_sampler);
     stats.print_stats(arch, "update", stats.set_sampler);
     stats.print_stats(arch, "op_q",   stats.op_sampler);
+    stats.print_stats(arch, "connect", stats.connect_sampler);
+    if (options.op_timeout > 0)
+      stats.print_stats(arch, "timeout", stats.timeout_sampler);
+    if (options.lambda > 0.0) {
+      stats.print_stats(arch, "resp", stats.response_sampler);
+      stats.print_stats(arch, "lag", stats.lag_sampler);
+      stats.print_stats(arch, "sched", stats.dispatch_sampler);
+      stats.print_stats(arch, "pacing", stats.pacing_sampler);
+    }
+    if (options.replicate)
+      stats.print_stats(arch, "fanout", stats.fanout_sampler);
+    if (options.open_loop) {
+      stats.print_stats(arch, "backlog", stats.backlog_sampler);
+      stats.print_stats(arch, "queued", stats.queued_sampler);
+    }
+    if (options.timestamping) {
+      stats.print_stats(arch, "kernel", stats.kernel_sampler);
+      stats.print_stats(arch, "client", stats.client_sampler);
+    }
+    if (options.churn > 0) {
+      if (options.sasl) stats.print_stats(arch, "sasl", stats.sasl_sampler);
+      stats.print_stats(arch, "first",  stats.first_sampler);
+    }
+    if (options.cache_aside)
+      stats.print_stats(arch, "app", stats.app_sampler);
 
     int total = stats.gets + stats.sets;
 
@@ -585,6 +841,9 @@ int main(int argc, char **argv) {
 
     if (args.search_given && peak_qps > 0.0)
       fprintf(arch, "Peak QPS  = %.1f\n", peak_qps);
+    if (options.measure_threads)
+      fprintf(arch, "Latency from %d measurement threads at %d QPS\n",
+              options.measure_threads, args.measure_qps_arg);
 
     fprintf(arch, "\n");
 
@@ -592,16 +851,109 @@ int main(int argc, char **argv) {
 
     fprintf(arch, "Misses = %" PRIu64 " (%.1f%%)\n", stats.get_misses,
             (double) stats.get_misses/stats.gets*100);
+    if (options.cache_aside)
+      fprintf(arch, "Fills = %" PRIu64 " (%.1f%% of sets)\n", stats.fills,
+              (double) stats.fills / stats.sets * 100);
 
     fprintf(arch, "Skipped TXs = %" PRIu64 " (%.1f%%)\n\n", stats.skips,
             (double) stats.skips / total * 100);
 
+    if (options.timestamping)
+      fprintf(arch, "Unusable kernel timestamps = %" PRIu64 " (%.1f%%)\n\n",
+              stats.kernel_skips, (double) stats.kernel_skips / total * 100);
+
+    if (options.open_loop == OPEN_LOOP_DROP)
+      fprintf(arch, "Dropped arrivals = %" PRIu64 " (%.1f%%)\n\n", stats.drops,
+              (double) stats.drops / (total + stats.drops) * 100);
+    if (options.open_loop == OPEN_LOOP_SPILL)
+      fprintf(arch, "Spilled arrivals = %" PRIu64 " (%.1f%%)\n\n",
+              stats.spills, (double) stats.spills / total * 100);
+
+    if (options.churn > 0)
+      fprintf(arch, "Churned connections = %" PRIu64 " (%.1f/s)\n\n",
+              stats.churns, stats.churns / (stats.stop - stats.start));
+
+    if (options.replicate)
+      fprintf(arch, "Fan-outs = %" PRIu64 ", failed %" PRIu64 " (%.1f%%)\n\n",
+              stats.fanouts, stats.fanout_fails, (double) stats.fanout_fails /
+              (stats.fanouts + stats.fanout_fails) * 100);
+
+    if (options.hedge) {
+      fprintf(arch, "Hedges = %" PRIu64 " (%.1f%% of gets, %.1f%% extra "
+              "load)\n", stats.hedges, (double) stats.hedges / stats.gets * 100,
+              (double) stats.hedges / total * 100);
+      fprintf(arch, "  Won by first copy = %" PRIu64 " (%.1f%%), by backup = %"
+              PRIu64 " (%.1f%%), late duplicates = %" PRIu64 "\n\n",
+              stats.hedges - stats.hedge_wins,
+              (double) (stats.hedges - stats.hedge_wins) / stats.hedges * 100,
+              stats.hedge_wins, (double) stats.hedge_wins / stats.hedges * 100,
+              stats.hedge_late);
+    }
+
+    if (options.rebalance > 0 || options.numa_incoming)
+      fprintf(arch, "Migrated connections = %" PRIu64 " (%.1f/s)\n\n",
+              stats.migrations, stats.migrations / (stats.stop - stats.start));
+
+    if (options.op_timeout > 0)
+      fprintf(arch, "Timeouts = %" PRIu64 " (%.1f%%)\n\n", stats.timeouts,
+              (double) stats.timeouts / (total + stats.timeouts) * 100);
+
+    // --op_timeout drops and reconnects even without --reconnect.
+    if (options.reconnect || !stats.server_stats.empty()) {
+      fprintf(arch, "Errors = %" PRIu64 " (%.1f%%)\n", stats.errors,
+              (double) stats.errors / (total + stats.errors) * 100);
+      for (auto &i: stats.server_stats) {
+        server_stats_t &s = i.second;
+        fprintf(arch, "  %s: %" PRIu64 " failures, %" PRIu64 " errors, "
+                "outage avg %.3fs max %.3fs, recovery avg %.1fms max %.1fms\n",
+                i.first.c_str(), s.failures, s.errors,
+                s.outages ? s.outage_sum / s.outages : 0.0, s.outage_max,
+                s.outages ? s.recovery_sum / s.outages * 1000 : 0.0,
+                s.recovery_max * 1000);
+      }
+      fprintf(arch, "\n");
+    }
+
+    if (options.ketama) {
+      KetamaRing ring(servers);
+      double elapsed = stats.stop - stats.start;
+
+      fprintf(arch, "Per server:\n");
+      for (unsigned int i = 0; i < ring.size(); i++) {
+        // Named as in the --reconnect rows above.
+        string name = servers[i].compare(0, 5, "unix:") ?
+          ring.name(i) : servers[i];
+
+        if (i >= stats.server_samplers.size() ||
+            stats.server_samplers[i].total() == 0) {
+          fprintf(arch, "  %s: 0 requests\n", name.c_str());
+          continue;
+        }
+
+        S &s = stats.server_samplers[i];
+        fprintf(arch, "  %s: %.1f QPS (%.1f%%), avg %.1fus, 50th %.1fus, "
+                "99th %.1fus\n", name.c_str(), s.total() / elapsed,
+                (double) s.total() / total * 100, s.average(),
+                s.get_nth(50), s.get_nth(99));
+      }
+      fprintf(arch, "\n");
+    }
+
+    for (unsigned int i = 0; i < stats.spin_time.size(); i++) {
+      double spin = stats.spin_time[i], sleep = stats.sleep_time[i];
+      fprintf(arch, "Thread %u loop: spin %.2fs, sleep %.2fs (%.1f%% spin)\n",
+              i, spin, sleep, spin + sleep > 0 ? spin / (spin + sleep) * 100 : 0);
+    }
+    if (stats.spin_time.size()) fprintf(arch, "\n");
+
     fprintf(arch, "RX %10" PRIu64 " bytes : %6.1f MB/s\n",
             stats.rx_bytes,
             (double) stats.rx_bytes / 1024 / 1024 / (stats.stop - stats.start));
     fprintf(arch, "TX %10" PRIu64 " bytes : %6.1f MB/s\n",
             stats.tx_bytes,
             (double) stats.tx_bytes / 1024 / 1024 / (stats.stop - stats.start));
+    fprintf(arch, "TX %10" PRIu64 " writes: %6.2f per request\n",
+            stats.tx_writes, total ? (double) stats.tx_writes / total : 0.0);
 
     char buf[64];
     double_tv_to_string(stats.start, buf, sizeof buf);
@@ -610,21 +962,28 @@ int main(int argc, char **argv) {
     double_tv_to_string(stats.stop, buf, sizeof buf);
     fprintf(arch, "Stop  Time: %s (%f)\n", buf, stats.stop);
 
-    if (args.archive_given || args.save_given) {
-      stats.get_sampler.accumulate(stats.set_sampler);
+    // Lossless, so archives from several runs or machines can be merged.
+    if (args.archive_given && options.sampler == SAMPLER_HDR) {
+      fprintf(arch, "\nread %s\n",
+              serialize_sampler(stats.get_sampler).c_str());
+      fprintf(arch, "update %s\n",
+              serialize_sampler(stats.set_sampler).c_str());
     }
 
+    // Merges only append samples; put them in order once, here.
+    sort(stats.samples.begin(), stats.samples.end());
+
     if (args.archive_given) {
       fprintf(arch, "\n======================================\n\n");
-      for (auto i: stats.get_sampler.samples) {
-        double_tv_to_string(i.start_time, buf, sizeof buf);
+      for (auto i: stats.samples) {
+        double_tv_to_string(i.start_time(), buf, sizeof buf);
         if (i.type == Operation::GETW || i.type == Operation::SETW) {
           fprintf(arch, "%s (%f) %f %s %f [#: %d, time: %f]\n", buf,
-            i.start_time, i.start_time - boot_time, i.toString(), i.time(),
+            i.start_time(), i.start_time() - boot_time, i.toString(), i.time(),
             i.switched, i.switchCost());
         } else {
-          fprintf(arch, "%s (%f) %f %s %f\n", buf, i.start_time,
-            i.start_time - boot_time, i.toString(), i.time());
+          fprintf(arch, "%s (%f) %f %s %f\n", buf, i.start_time(),
+            i.start_time() - boot_time, i.toString(), i.time());
         }
       }
     }
@@ -638,31 +997,18 @@ int main(int argc, char **argv) {
         DIE("--save: failed to open %s: %s", args.save_arg, strerror(errno));
       }
 
-      for (auto i: stats.get_sampler.samples) {
-        fprintf(file, "%f %f %s %f\n", i.start_time, i.start_time - boot_time,
-                i.toString(), i.time());
+      for (auto i: stats.samples) {
+        fprintf(file, "%f %f %s %f\n", i.start_time(),
+                i.start_time() - boot_time, i.toString(), i.time());
       }
       fclose(file);
     }
   }
-
-  //  if (args.threads_arg > 1) 
-    pthread_barrier_destroy(&barrier);
-
-#ifdef HAVE_LIBZMQ
-  if (args.agent_given) {
-    for (auto i: agent_sockets) delete i;
-  }
-#endif
-
-  // evdns_base_free(evdns, 0);
-  // event_base_free(base);
-
-  cmdline_parser_free(&args);
 }
 
+template <class S>
 void go(const vector<string>& servers, options_t& options,
-        ConnectionStats &stats
+        BasicConnectionStats<S> &stats
 #ifdef HAVE_LIBZMQ
 , zmq::socket_t* socket
 #endif
@@ -673,9 +1019,47 @@ void go(const vector<string>& servers, options_t& options,
   }
 #endif
 
-  if (options.threads > 1) {
-    pthread_t pt[options.threads];
-    struct thread_data td[options.threads];
+  int endpoints = 0;
+  for (auto s: servers) endpoints += count(s.begin(), s.end(), '|') + 1;
+  int conns = args.measure_connections_given && !options.measure_threads ?
+    args.measure_connections_arg : options.connections;
+
+  // --measure_threads: what the probe threads run instead of options.
+  options_t probe = options;
+  if (options.measure_threads) {
+    probe.probe = true;
+    probe.noload = true; // The load threads have loaded the keys.
+    probe.connections = args.measure_connections_given ?
+      args.measure_connections_arg : 1;
+    probe.depth = args.measure_depth_given ? args.measure_depth_arg : 1;
+    if (probe.open_loop == OPEN_LOOP_OFF) probe.open_loop = OPEN_LOOP_QUEUE;
+    // Probes stay put and at their own rate: they never join
+    // --rebalance or --numa_incoming, so no load lands on them, and
+    // open no --churn connections of their own.
+    probe.rebalance = 0.0;
+    probe.numa_incoming = false;
+    probe.churn = 0.0;
+    probe.lambda = (double) args.measure_qps_arg /
+      (options.measure_threads * probe.connections *
+       (options.ketama ? 1 : servers.size()));
+  }
+  int threads = options.threads + options.measure_threads;
+
+  raise_fd_limit((rlim_t) (conns * options.threads + probe.connections *
+                           options.measure_threads) * endpoints + 64);
+
+  pthread_t reporter;
+  if (options.report > 0) {
+    for (int t = 0; t < threads; t++)
+      report_buffers<S>().push_back(new IntervalBuffer<S>());
+    report_joined = 0;
+    if (pthread_create(&reporter, NULL, report_main<S>, &options))
+      DIE("pthread_create() failed");
+  }
+
+  if (threads > 1) {
+    pthread_t pt[threads];
+    struct thread_data td[threads];
 #ifdef __clang__
     vector<string>* ts = static_cast<vector<string>*>(alloca(sizeof(vector<string>) * options.threads));
 #else
@@ -685,16 +1069,40 @@ void go(const vector<string>& servers, options_t& options,
 #ifdef __linux__
     int current_cpu = -1;
 #endif
+#ifdef HAVE_LIBNUMA
+    vector<cpu_set_t> node_cpus;
+    if (options.numa) node_cpus = numa_node_cpus();
+    vector<int> node_cpu(node_cpus.size(), -1); // Last --affinity CPU.
+#endif
+#ifdef __linux__
+    // --measure_threads: a CPU for each probe, from the end of our
+    // affinity mask, that the load threads keep off.
+    cpu_set_t allowed, probe_cpus;
+    vector<int> probe_cpu;
+    CPU_ZERO(&probe_cpus);
+    sched_getaffinity(0, sizeof(cpu_set_t), &allowed);
+    if (options.measure_threads >= CPU_COUNT(&allowed)) {
+      if (options.measure_threads)
+        W("Too few CPUs to give each --measure_threads thread its own.");
+    } else {
+      for (int c = CPU_SETSIZE - 1;
+           c >= 0 && (int) probe_cpu.size() < options.measure_threads; c--) {
+        if (!CPU_ISSET(c, &allowed)) continue;
+        CPU_SET(c, &probe_cpus);
+        probe_cpu.push_back(c);
+      }
+    }
+#endif
 
-    for (int t = 0; t < options.threads; t++) {
-      td[t].options = &options;
+    for (int t = 0; t < threads; t++) {
+      td[t].options = t < options.threads ? &options : &probe;
 #ifdef HAVE_LIBZMQ
       td[t].socket = socket;
 #endif
       if (t == 0) td[t].master = true;
       else td[t].master = false;
 
-      if (options.roundrobin) {
+      if (options.roundrobin && t < options.threads) {
         for (unsigned int i = (t % servers.size());
              i < servers.size(); i += options.threads)
           ts[t].push_back(servers[i % servers.size()]);
@@ -707,6 +1115,42 @@ void go(const vector<string>& servers, options_t& options,
       pthread_attr_t attr;
       pthread_attr_init(&attr);
 
+#ifdef __linux__
+      if (t >= options.threads) {
+        if (!probe_cpu.empty()) {
+          cpu_set_t m;
+          CPU_ZERO(&m);
+          CPU_SET(probe_cpu[t - options.threads], &m);
+          int ret;
+          if ((ret = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t),
+                                                 &m)))
+            DIE("pthread_attr_setaffinity_np() failed: %s", strerror(ret));
+        }
+      } else
+#endif
+#ifdef HAVE_LIBNUMA
+      if (options.numa) {
+        // Spread threads over the nodes, and with --affinity pin each to
+        // the next CPU of its node.
+        unsigned int n = t % node_cpus.size();
+        cpu_set_t m = node_cpus[n];
+        for (int c = 0; c < CPU_SETSIZE; c++)
+          if (CPU_ISSET(c, &probe_cpus)) CPU_CLR(c, &m);
+        if (CPU_COUNT(&m) == 0) m = node_cpus[n]; // The probes took it all.
+
+        if (args.affinity_given) {
+          int c = node_cpu[n];
+          do c = (c + 1) % CPU_SETSIZE; while (!CPU_ISSET(c, &m));
+          CPU_ZERO(&m);
+          CPU_SET(c, &m);
+          node_cpu[n] = c;
+        }
+
+        int ret;
+        if ((ret = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &m)))
+          DIE("pthread_attr_setaffinity_np() failed: %s", strerror(ret));
+      } else
+#endif
 #ifdef __linux__
       if (args.affinity_given) {
         int max_cpus = 8 * sizeof(cpu_set_t);
@@ -716,7 +1160,7 @@ void go(const vector<string>& servers, options_t& options,
 
         for (int i = 0; i < max_cpus; i++) {
           int c = (current_cpu + i + 1) % max_cpus;
-          if (CPU_ISSET(c, &m)) {
+          if (CPU_ISSET(c, &m) && !CPU_ISSET(c, &probe_cpus)) {
             CPU_ZERO(&m);
             CPU_SET(c, &m);
             int ret;
@@ -728,20 +1172,26 @@ void go(const vector<string>& servers, options_t& options,
             break;
           }
         }
+      } else if (!probe_cpu.empty()) {
+        cpu_set_t m = allowed;
+        for (int c : probe_cpu) CPU_CLR(c, &m);
+        int ret;
+        if ((ret = pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &m)))
+          DIE("pthread_attr_setaffinity_np() failed: %s", strerror(ret));
       }
 #endif
 
-      if (pthread_create(&pt[t], &attr, thread_main, &td[t]))
+      if (pthread_create(&pt[t], &attr, thread_main<S>, &td[t]))
         DIE("pthread_create() failed");
     }
 
-    for (int t = 0; t < options.threads; t++) {
-      ConnectionStats *cs;
+    for (int t = 0; t < threads; t++) {
+      BasicConnectionStats<S> *cs;
       if (pthread_join(pt[t], (void**) &cs)) DIE("pthread_join() failed");
       stats.accumulate(*cs);
       delete cs;
     }
-  } else if (options.threads == 1) {
+  } else if (threads == 1) {
     do_mutilate(servers, options, stats, true
 #ifdef HAVE_LIBZMQ
 , socket
@@ -766,12 +1216,86 @@ void go(const vector<string>& servers, options_t& options,
     finish_agent(stats);
   }
 #endif
+
+  if (options.report > 0) {
+    if (pthread_join(reporter, NULL)) DIE("pthread_join() failed");
+    for (auto b: report_buffers<S>()) delete b;
+    report_buffers<S>().clear();
+  }
+}
+
+/**
+ * --report: collect each thread's intervals as it finishes them, and
+ * print one line per interval once every thread still running has
+ * finished it.  Threads never wait on each other, or on us for long.
+ */
+template <class S> void* report_main(void *arg) {
+  options_t* options = (options_t*) arg;
+  vector<IntervalBuffer<S>*> &buffers = report_buffers<S>();
+  vector<deque<IntervalStats<S>>> pending(buffers.size());
+  double origin = 0.0;
+
+  printf("%-9s %7s %9s %8s %8s %8s %8s %8s %8s %7s %7s\n", "#interval",
+         "time", "QPS", "avg", "50th", "90th", "99th", "99.9th", "max",
+         "misses", "errors");
+
+  for (uint64_t k = 0; ; ) {
+    bool waiting = false, have = false;
+
+    for (size_t t = 0; t < buffers.size(); t++) {
+      IntervalBuffer<S>* b = buffers[t];
+      bool done = b->done.load(memory_order_acquire); // Before ready.
+      uint64_t ready = b->ready.load(memory_order_acquire);
+
+      for (uint64_t j = b->taken.load(); j < ready; j++) {
+        pending[t].push_back(b->bufs[j & 1]);
+        b->bufs[j & 1].clear();
+        b->taken.store(j + 1, memory_order_release);
+      }
+
+      if (!pending[t].empty()) have = true;
+      else if (!done) waiting = true;
+    }
+
+    if (waiting) {
+      usleep(1000);
+      continue;
+    }
+    if (!have) break;
+
+    IntervalStats<S> merged;
+    for (auto &p: pending) {
+      if (p.empty()) continue;
+      merged.accumulate(p.front());
+      p.pop_front();
+    }
+    if (k++ == 0) origin = merged.start;
+
+    interval_counts_t &c = merged.counts;
+    S &l = merged.latency;
+
+    // The sliver between the last tick and the end of the run.
+    if (merged.stop - merged.start < options->report / 10 &&
+        c.gets + c.sets + c.errors + c.timeouts == 0)
+      continue;
+
+    bool any = l.total() > 0; // An interval with no replies has no latency.
+    printf("interval  %7.1f %9.1f %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f "
+           "%7" PRIu64 " %7" PRIu64 "\n", merged.stop - origin,
+           (c.gets + c.sets) / (merged.stop - merged.start),
+           any ? l.average() : 0.0, any ? l.get_nth(50) : 0.0,
+           any ? l.get_nth(90) : 0.0, any ? l.get_nth(99) : 0.0,
+           any ? l.get_nth(99.9) : 0.0, any ? l.maximum() : 0.0,
+           c.get_misses, c.errors + c.timeouts);
+  }
+
+  return NULL;
 }
 
-void* thread_main(void *arg) {
+template <class S> void* thread_main(void *arg) {
   struct thread_data *td = (struct thread_data *) arg;
 
-  ConnectionStats *cs = new ConnectionStats();
+  BasicConnectionStats<S> *cs = new BasicConnectionStats<S>();
 
   do_mutilate(*td->servers, *td->options, *cs, td->master
 #ifdef HAVE_LIBZMQ
@@ -782,19 +1306,35 @@ void* thread_main(void *arg) {
   return cs;
 }
 
+template <class S>
 void do_mutilate(const vector<string>& servers, options_t& options,
-                 ConnectionStats& stats, bool master
+                 BasicConnectionStats<S>& stats, bool master
 #ifdef HAVE_LIBZMQ
 , zmq::socket_t* socket
 #endif
 ) {
   int loop_flag =
     (options.blocking || args.blocking_given) ? EVLOOP_ONCE : EVLOOP_NONBLOCK;
+  if (options.spin > 0) loop_flag = EVLOOP_NONBLOCK;
+  double spin = 0.0, sleep = 0.0, last_event = 0.0;
 
   struct event_base *base;
   struct evdns_base *evdns;
   struct event_config *config;
 
+  // --numa: everything this thread allocates from here on comes from
+  // its own node, and value bytes from a copy there.
+  int node = -1;
+  const char* values = random_char;
+#ifdef HAVE_LIBNUMA
+  if (options.numa) {
+    numa_set_localalloc();
+    node = cpu_node(sched_getcpu());
+    values = numa_values(node);
+    V("Thread running on NUMA node %d.", node);
+  }
+#endif
+
   if ((config = event_config_new()) == NULL) DIE("event_config_new() fail");
 
 #ifdef HAVE_DECL_EVENT_BASE_FLAG_PRECISE_TIMER
@@ -815,34 +1355,118 @@ void do_mutilate(const vector<string>& servers, options_t& options,
   double start = get_time();
   double now = start;
 
-  vector<Connection*> connections;
-  vector<Connection*> server_lead;
+  vector<BasicConnection<S>*> connections;
+  vector<BasicConnection<S>*> server_lead;
+
+  int conns = args.measure_connections_given && !options.measure_threads ?
+    args.measure_connections_arg : options.connections;
+
+  UringEngine *uring = NULL;
+  if (options.io_uring) {
+    int slots = 0;
+    for (auto s: servers)
+      slots += conns * (count(s.begin(), s.end(), '|') + 1);
+    uring = new UringEngine(base, slots);
+  }
+
+  thread_state_t<S> ts;
+  ts.base = base;
+  ts.evdns = evdns;
+  ts.uring = uring;
+  ts.options = options;
+  // Under --measure_threads only the probes sample latency.
+  ts.stats = BasicConnectionStats<S>(
+    !args.agentmode_given && (!options.measure_threads || options.probe),
+    args.save_given || args.archive_given);
+  ts.start_time = 0;
+  ts.node = node;
+  ts.values = values;
+  ts.busy = ts.down = 0;
+  ts.churn_timer = NULL;
+  ts.churn_gen = NULL;
+  ts.connecting = 0;
+  ts.op_wheel = NULL;
+  ts.op_timer = NULL;
+  ts.ring = NULL;
+  ts.hedge_wheel = NULL;
+  ts.hedge_latency = NULL;
+  ts.hedge_delay = 0.0;
+  ts.hedge_samples = 0;
+  ts.rebalance_timer = NULL;
+  ts.interval = NULL;
+  ts.interval_timer = NULL;
+  ts.mailbox_event = NULL;
+  ts.idle_time = 0.0;
+  if (options.hedge) {
+    ts.hedge_wheel = new TimingWheel<op_ref_t>(get_time(), 0.000001);
+    ts.hedge_latency = new LogHistogramSampler(200);
+  }
+  ts.backend = NULL;
+  ts.backend_wheel = NULL;
+  if (options.cache_aside) {
+    ts.backend = createGenerator(options.backend);
+    ts.backend_wheel = new TimingWheel<session_ref_t<S>>(get_time(), 0.000001);
+  }
 
-  for (auto s: servers) {
-    int conns = args.measure_connections_given ?
-      args.measure_connections_arg : options.connections;
+  // 1us ticks: the scheduler's resolution is far below libevent's.
+  ts.sched = new TimingWheel<sched_ref_t<S>>(get_time(), 0.000001);
+  ts.sched_timer = evtimer_new(base, sched_cb<S>, &ts);
+  ts.sched_armed = 0.0;
 
+  if (options.op_timeout > 0) {
+    // 16 ticks per timeout: deadlines fire at most 1/16th late.
+    double tick = options.op_timeout / 16.0 / 1000000;
+
+    if (tick < 0.000001) tick = 0.000001;
+    ts.op_wheel = new TimingWheel<op_ref_t>(get_time(), tick);
+    ts.op_timer = evtimer_new(base, op_timer_cb<S>, &ts);
+    ts.op_armed = 0.0;
+  }
+
+  ts.valuesize = createGenerator(options.valuesize);
+  ts.keysize = createGenerator(options.keysize);
+  ts.keygen = new KeyGenerator(ts.keysize, options.records);
+
+  if (options.lambda <= 0) {
+    ts.iagen = createGenerator("0");
+  } else {
+    D("iagen = createGenerator(%s)", options.ia);
+    ts.iagen = createGenerator(options.ia);
+    ts.iagen->set_lambda(options.lambda);
+  }
+
+  if (options.ketama) {
+    // Every Connection holds all the servers and the ring picks one per
+    // key, so one of them loads everything.
+    string hosts;
+    for (auto s: servers) hosts += (hosts.empty() ? "" : "|") + s;
+
+    ts.ring = new KetamaRing(servers);
     for (int c = 0; c < conns; c++) {
-      Connection* conn = new Connection(base, evdns, options, s,
-                                        args.agentmode_given ? false : true);
+      BasicConnection<S>* conn = new BasicConnection<S>(&ts, hosts);
       connections.push_back(conn);
+      ts.connect_queue.push_back(conn);
       if (c == 0) server_lead.push_back(conn);
     }
+  } else {
+    for (auto s: servers) {
+      for (int c = 0; c < conns; c++) {
+        BasicConnection<S>* conn = new BasicConnection<S>(&ts, s);
+        connections.push_back(conn);
+        ts.connect_queue.push_back(conn);
+        if (c == 0) server_lead.push_back(conn);
+      }
+    }
   }
+  ts.conns = connections;
 
-  // Wait for all Connections to become IDLE.
-  while (1) {
-    // FIXME: If all connections become ready before event_base_loop
-    // is called, this will deadlock.
-    event_base_loop(base, EVLOOP_ONCE);
-
-    bool restart = false;
-    for (Connection *conn: connections)
-      if (!conn->is_ready()) restart = true;
-
-    if (restart) continue;
-    else break;
-  }
+  // Connect with bounded parallelism; each completed connect starts the
+  // next queued one, and ts.busy drops to zero once all are IDLE.
+  double connect_start = get_time();
+  connect_pending(&ts);
+  while (ts.busy > 0) loop_once(&ts, EVLOOP_ONCE);
+  V("Connected %zu connections in %.2fs.", connections.size(),
+    get_time() - connect_start);
 
   // Load database on lead connection for each server.
   if (!options.noload) {
@@ -851,21 +1475,12 @@ void do_mutilate(const vector<string>& servers, options_t& options,
     for (auto c: server_lead) c->start_loading();
 
     // Wait for all Connections to become IDLE.
-    while (1) {
-      // FIXME: If all connections become ready before event_base_loop
-      // is called, this will deadlock.
-      event_base_loop(base, EVLOOP_ONCE);
-
-      bool restart = false;
-      for (Connection *conn: connections)
-        if (!conn->is_ready()) restart = true;
-
-      if (restart) continue;
-      else break;
-    }
+    while (ts.busy > 0) loop_once(&ts, EVLOOP_ONCE);
   }
 
   if (options.loadonly) {
+    for (BasicConnection<S> *conn: connections) delete conn;
+    free_thread_state(&ts);
     evdns_base_free(evdns, 0);
     event_base_free(base);
     return;
@@ -890,62 +1505,44 @@ void do_mutilate(const vector<string>& servers, options_t& options,
     }
 #endif
 
-    int old_time = options.time;
-
-    start = get_time();
-    for (Connection *conn: connections) {
-      conn->start_time = start;
-      conn->options.time = options.warmup;
+    ts.options.time = options.warmup;
+    ts.start_time = start = get_time();
+    for (BasicConnection<S> *conn: connections)
       conn->start(); // Kick the Connection into motion.
-    }
 
     while (1) {
-      event_base_loop(base, loop_flag);
+      loop_timed(&ts, loop_flag, options, spin, sleep, last_event);
 
       struct timeval now_tv;
       event_base_gettimeofday_cached(base, &now_tv);
       now = tv_to_double(&now_tv);
 
-      bool restart = false;
-      for (Connection *conn: connections)
-        if (!conn->check_exit_condition(now))
-          restart = true;
-
-      if (restart) continue;
-      else break;
+      if (now > ts.start_time + ts.options.time) break;
     }
 
-    bool restart = false;
-    for (Connection *conn: connections)
-      if (!conn->is_ready()) restart = true;
+    // Wait for all Connections to become IDLE, but not for servers that
+    // are down under --reconnect: those stay busy until they are back.
+    while (ts.busy > ts.down) loop_once(&ts, EVLOOP_ONCE);
 
-    if (restart) {
-
-    // Wait for all Connections to become IDLE.
-    while (1) {
-      // FIXME: If there were to use EVLOOP_ONCE and all connections
-      // become ready before event_base_loop is called, this will
-      // deadlock.  We should check for IDLE before calling
-      // event_base_loop.
-      event_base_loop(base, EVLOOP_ONCE); // EVLOOP_NONBLOCK);
-
-      bool restart = false;
-      for (Connection *conn: connections)
-        if (!conn->is_ready()) restart = true;
-
-      if (restart) continue;
-      else break;
-    }
-    }
-
-    for (Connection *conn: connections) {
-      conn->reset();
-      conn->options.time = old_time;
-    }
+    for (BasicConnection<S> *conn: connections) conn->reset();
+    ts.options.time = options.time;
 
     if (master) V("Warmup stop.");
   }
 
+  // Only count what happens from here on, but keep the startup connects.
+  auto connect_sampler = ts.stats.connect_sampler;
+  ts.stats = BasicConnectionStats<S>(ts.stats.sampling,
+                                     ts.stats.save_samples);
+  ts.stats.connect_sampler = connect_sampler;
+  if (ts.stats.save_samples && options.reserve > 0)
+    ts.stats.samples.reserve(options.reserve * conns + 1);
+  spin = sleep = 0.0;
+
+  // Every thread that may be handed Connections is ready for them
+  // before any thread starts.
+  if (options.rebalance > 0 || options.numa_incoming) rebalance_join(&ts);
+
   // FIXME: Synchronize start_time here across threads/nodes.
   pthread_barrier_wait(&barrier);
 
@@ -977,59 +1574,265 @@ void do_mutilate(const vector<string>& servers, options_t& options,
   if (master && !args.scan_given && !args.search_given)
     V("started at %f", get_time());
 
-  start = get_time();
-  for (Connection *conn: connections) {
-    conn->start_time = start;
+  ts.start_time = start = get_time();
+  for (BasicConnection<S> *conn: connections)
     conn->start(); // Kick the Connection into motion.
+  if (options.numa_incoming) rebalance_incoming(&ts);
+  if (options.report > 0) interval_begin(&ts, report_buffers<S>()[report_joined++]);
+
+  if (options.churn > 0) {
+    ts.churn_gen = new Exponential(options.churn);
+    ts.churn_hosts = servers;
+    ts.churn_next = 0;
+    ts.churn_due = start + ts.churn_gen->generate();
+    ts.churn_timer = evtimer_new(base, churn_cb<S>, &ts);
+    churn_cb<S>(-1, 0, &ts);
   }
 
-  // Main event loop.
+  // Main event loop.  Every Connection shares the same start time and
+  // duration, so there is no need to poll each one for its exit condition.
   while (1) {
-    event_base_loop(base, loop_flag);
+    loop_timed(&ts, loop_flag, options, spin, sleep, last_event);
 
     struct timeval now_tv;
     event_base_gettimeofday_cached(base, &now_tv);
     now = tv_to_double(&now_tv);
 
-    bool restart = false;
-    for (Connection *conn: connections) {
-      if (!conn->check_exit_condition(now)) restart = true;
-    }
-
-    if (restart) continue;
-    else break;
+    if (now > ts.start_time + ts.options.time) break;
   }
 
   if (master && !args.scan_given && !args.search_given) {
     V("stopped at %f  options.time = %d", get_time(), options.time);
   }
 
-  // Tear-down and accumulate stats.
-  for (Connection *conn: connections) {
-    stats.accumulate(conn->stats);
-    delete conn;
-  }
+  if (ts.interval) interval_flip(&ts, true);
+
+  // Tear-down and accumulate stats.  --rebalance may have moved
+  // Connections in and out, so ts.conns is what this thread now runs.
+  if (ts.mailbox_event) rebalance_leave(&ts);
+  for (BasicConnection<S> *conn: ts.conns) delete conn;
+  for (BasicConnection<S> *conn: ts.moved) delete conn;
+  for (BasicConnection<S> *conn: ts.churn_active) delete conn;
 
+  stats.accumulate(ts.stats);
   stats.start = start;
   stats.stop = now;
+  stats.spin_time.push_back(spin);
+  stats.sleep_time.push_back(sleep);
 
+  free_thread_state(&ts);
   event_config_free(config);
   evdns_base_free(evdns, 0);
   event_base_free(base);
 }
 
+/**
+ * Free the generators and I/O engine owned by a thread's shared state.
+ */
+template <class S> void free_thread_state(thread_state_t<S>* ts) {
+  if (ts->uring) delete ts->uring;
+  if (ts->churn_timer) event_free(ts->churn_timer);
+  if (ts->churn_gen) delete ts->churn_gen;
+  if (ts->op_timer) event_free(ts->op_timer);
+  if (ts->op_wheel) delete ts->op_wheel;
+  if (ts->ring) delete ts->ring;
+  if (ts->hedge_wheel) delete ts->hedge_wheel;
+  if (ts->hedge_latency) delete ts->hedge_latency;
+  if (ts->backend) delete ts->backend;
+  if (ts->backend_wheel) delete ts->backend_wheel;
+  event_free(ts->sched_timer);
+  delete ts->sched;
+  delete ts->iagen;
+  delete ts->keygen;
+  delete ts->keysize;
+  delete ts->valuesize;
+}
+
+/**
+ * Run one pass of the event loop, first handing any queued io_uring
+ * submissions or --cork output to the kernel.
+ */
+template <class S> void loop_once(thread_state_t<S>* ts, int flags) {
+  if (ts->uring) ts->uring->submit();
+  flush_corked(ts);
+  churn_reap(ts);
+  arm_scheduler(ts);
+  if (ts->op_wheel) arm_op_timer(ts);
+  event_base_loop(ts->base, flags);
+}
+
+/**
+ * Run one pass of the load-generating event loop, charging its wall
+ * time to spin or sleep.  With --spin, a non-blocking pass is upgraded
+ * to a blocking one once options.spin microseconds have gone by without
+ * any callback firing.
+ */
+template <class S>
+void loop_timed(thread_state_t<S>* ts, int flags, options_t& options,
+                double& spin, double& sleep, double& last_event) {
+  uint64_t events = loop_events;
+  double before = get_time();
+
+  if (options.spin > 0 && before - last_event > options.spin / 1000000.0)
+    flags = EVLOOP_ONCE;
+
+  loop_once(ts, flags);
+
+  double after = get_time();
+  if (flags == EVLOOP_ONCE) sleep += after - before;
+  else spin += after - before;
+
+  // Spinning, which --rebalance takes out of the CPU time it samples.
+  if (loop_events != events) last_event = after;
+  else if (flags != EVLOOP_ONCE) ts->idle_time += after - before;
+}
+
+/**
+ * Make sure we may open at least want file descriptors, raising the soft
+ * RLIMIT_NOFILE up to the hard limit if necessary.
+ */
+void raise_fd_limit(rlim_t want) {
+  struct rlimit rl;
+
+  if (getrlimit(RLIMIT_NOFILE, &rl)) DIE("getrlimit(RLIMIT_NOFILE) failed");
+  if (rl.rlim_cur >= want) return;
+
+  rlim_t old = rl.rlim_cur;
+  rl.rlim_cur = rl.rlim_max == RLIM_INFINITY || rl.rlim_max >= want ?
+    want : rl.rlim_max;
+  if (setrlimit(RLIMIT_NOFILE, &rl)) rl.rlim_cur = old;
+
+  if (rl.rlim_cur < want)
+    W("Need %lu file descriptors but RLIMIT_NOFILE only allows %lu.",
+      (unsigned long) want, (unsigned long) rl.rlim_cur);
+  else
+    V("Raised RLIMIT_NOFILE from %lu to %lu.",
+      (unsigned long) old, (unsigned long) rl.rlim_cur);
+}
+
+#ifdef HAVE_LIBNUMA
+/**
+ * The CPUs of each NUMA node that we may run on, leaving out nodes with
+ * none.
+ */
+vector<cpu_set_t> numa_node_cpus() {
+  vector<cpu_set_t> nodes;
+  cpu_set_t allowed;
+  struct bitmask* cpus = numa_allocate_cpumask();
+
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+  for (int n = 0; n <= numa_max_node(); n++) {
+    cpu_set_t m;
+    CPU_ZERO(&m);
+    if (numa_node_to_cpus(n, cpus)) continue;
+
+    for (unsigned int c = 0; c < cpus->size && c < CPU_SETSIZE; c++)
+      if (numa_bitmask_isbitset(cpus, c) && CPU_ISSET(c, &allowed))
+        CPU_SET(c, &m);
+    if (CPU_COUNT(&m) > 0) nodes.push_back(m);
+  }
+
+  numa_free_cpumask(cpus);
+  if (nodes.empty()) DIE("--numa: no NUMA node has a CPU we may run on.");
+  V("--numa: spreading threads over %zu nodes.", nodes.size());
+  return nodes;
+}
+
+/**
+ * A copy of random_char on a NUMA node, made by the first thread there
+ * to ask and kept until exit.
+ */
+const char* numa_values(int node) {
+  static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  static vector<char*> copies;
+
+  pthread_mutex_lock(&lock);
+  if (copies.size() <= (size_t) node) copies.resize(node + 1, NULL);
+  if (copies[node] == NULL) {
+    copies[node] = (char*) numa_alloc_onnode(sizeof(random_char), node);
+    if (copies[node] == NULL) DIE("numa_alloc_onnode(%d) failed", node);
+    memcpy(copies[node], random_char, sizeof(random_char));
+  }
+  char* values = copies[node];
+  pthread_mutex_unlock(&lock);
+
+  return values;
+}
+#endif
+
 void args_to_options(options_t* options) {
   options->connections = args.connections_arg;
   options->blocking = args.blocking_given;
+  options->io_uring = args.io_uring_given;
+  options->spin = args.spin_given ? args.spin_arg : 0;
+  options->busy_poll = args.busy_poll_given ? args.busy_poll_arg : 0;
+  options->cork = args.cork_given;
   options->qps = args.qps_arg;
   options->threads = args.threads_arg;
   options->server_given = args.server_given;
   options->roundrobin = args.roundrobin_given;
+  options->ketama = args.ketama_given;
+  options->read_replica = args.read_replica_arg;
+  options->hedge = args.hedge_given;
+  options->hedge_delay = options->hedge_nth = 0.0;
+  if (args.hedge_given && args.hedge_arg[0] == 'p')
+    options->hedge_nth = atof(args.hedge_arg + 1);
+  else if (args.hedge_given)
+    options->hedge_delay = atof(args.hedge_arg);
+  options->rebalance = args.rebalance_given ? args.rebalance_arg : 0.0;
+  options->numa = args.numa_given;
+  options->numa_incoming = args.numa_incoming_given;
+  options->report = args.report_given ? args.report_arg : 0.0;
+  options->measure_threads =
+    args.measure_threads_given ? args.measure_threads_arg : 0;
+  options->probe = false;
+  options->cache_aside = args.cache_aside_given;
+  options->backend[0] = '\0';
+  if (args.cache_aside_given) strcpy(options->backend, args.cache_aside_arg);
+  options->churn = args.churn_given ?
+    (double) args.churn_arg / options->threads : 0.0;
+  options->churn_requests = args.churn_requests_arg;
+  options->connect_parallel = args.connect_parallel_arg;
+  options->connect_timeout = args.connect_timeout_arg;
+  options->reconnect = args.reconnect_given;
+  options->backoff_min = args.backoff_min_arg;
+  options->backoff_max = args.backoff_max_arg;
+  options->op_timeout = args.op_timeout_given ? args.op_timeout_arg : 0;
+  options->timeout_wait = args.timeout_wait_given;
+  options->timestamping = args.timestamping_given;
+  options->open_loop = OPEN_LOOP_OFF;
+  if (args.open_loop_given) {
+    if (!strcmp(args.open_loop_arg, "queue"))
+      options->open_loop = OPEN_LOOP_QUEUE;
+    else if (!strcmp(args.open_loop_arg, "drop"))
+      options->open_loop = OPEN_LOOP_DROP;
+    else
+      options->open_loop = OPEN_LOOP_SPILL;
+  }
+
+  options->sampler = SAMPLER_LOG;
+  if (!strcmp(args.sampler_arg, "hdr")) options->sampler = SAMPLER_HDR;
+  else if (!strcmp(args.sampler_arg, "linear"))
+    options->sampler = SAMPLER_LINEAR;
+  else if (!strcmp(args.sampler_arg, "exact"))
+    options->sampler = SAMPLER_EXACT;
+
+  options->replicate = REPLICATE_OFF;
+  if (args.replicate_given) {
+    if (!strcmp(args.replicate_arg, "first"))
+      options->replicate = REPLICATE_FIRST;
+    else if (!strcmp(args.replicate_arg, "quorum"))
+      options->replicate = REPLICATE_QUORUM;
+    else
+      options->replicate = REPLICATE_ALL;
+  }
 
   int connections = options->connections;
   if (options->roundrobin) {
     connections *= (options->server_given > options->threads ?
                     options->server_given : options->threads);
+  } else if (options->ketama) {
+    connections *= options->threads;
   } else {
     connections *= options->server_given * options->threads;
   }
@@ -1049,7 +1852,9 @@ void args_to_options(options_t* options) {
   //  if (args.no_record_scale_given)
   //    options->records = args.records_arg;
   //  else
-  if (options->server_given)
+  if (options->ketama)
+    options->records = args.records_arg; // The ring splits them.
+  else if (options->server_given)
     options->records = args.records_arg / options->server_given;
   else
     options->records = 0;
@@ -5,11 +5,12 @@
 
 #define USE_CACHED_TIME 0
 #define MINIMUM_KEY_LENGTH 2
-#define MAXIMUM_CONNECTIONS 512
+#define MAXIMUM_CONNECTIONS 1000000
 
 #define MAX_SAMPLES 100000
 
 #define LOADER_CHUNK 50
+#define HEDGE_WINDOW 1000 // GETs between --hedge=pN delay updates.
 
 extern char random_char[];
 extern gengetopt_args_info args;
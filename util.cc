@@ -1,12 +1,21 @@
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <map>
+
 #include <event2/bufferevent.h>
 
+#include "config.h"
+
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
 #include "log.h"
 #include "util.h"
 
@@ -14,6 +23,18 @@ void sleep_time(double duration) {
   if (duration > 0) usleep((useconds_t) (duration * 1000000));
 }
 
+/**
+ * NUMA node of a CPU, or 0 without libnuma.
+ */
+int cpu_node(int cpu) {
+#ifdef HAVE_LIBNUMA
+  int node = numa_node_of_cpu(cpu);
+  return node < 0 ? 0 : node;
+#else
+  return 0;
+#endif
+}
+
 #define FNV_64_PRIME (0x100000001b3ULL)
 #define FNV1_64_INIT (0xcbf29ce484222325ULL)
 uint64_t fnv_64_buf(const void* buf, size_t len) {
@@ -34,12 +55,25 @@ void generate_key(int n, int length, char *buf) {
   snprintf(buf, length + 1, "%0*d", length, n);
 }
 
+static map<string, string> ipaddr_cache;
+static pthread_mutex_t ipaddr_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /**
- * Convert a hostname into an IP address.
+ * Convert a hostname into an IP address.  Each name is only looked up
+ * once per process; every later connection shares the answer.
  */
 string name_to_ipaddr(string host) {
+  pthread_mutex_lock(&ipaddr_lock);
+
+  auto cached = ipaddr_cache.find(host);
+  if (cached != ipaddr_cache.end()) {
+    string ipaddr = cached->second;
+    pthread_mutex_unlock(&ipaddr_lock);
+    return ipaddr;
+  }
+
   void *ptr = NULL;
-  char ipaddr[16];
+  char ipaddr[INET6_ADDRSTRLEN];
   struct evutil_addrinfo hints;
   struct evutil_addrinfo* answer = NULL;
   int err;
@@ -69,9 +103,12 @@ string name_to_ipaddr(string host) {
     break;
   }
 
-  inet_ntop (answer->ai_family, ptr, ipaddr, 16);
+  inet_ntop (answer->ai_family, ptr, ipaddr, sizeof(ipaddr));
+  evutil_freeaddrinfo(answer);
 
   D("Resolved %s to %s", host.c_str(), ipaddr);
+  ipaddr_cache[host] = ipaddr;
+  pthread_mutex_unlock(&ipaddr_lock);
   return string(ipaddr);
 }
 
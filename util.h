@@ -51,8 +51,19 @@ inline double get_time() {
   return tv_to_double(&tv);
 }
 
+/**
+ * CPU time this thread has used, in seconds.
+ */
+inline double get_thread_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + (double) ts.tv_nsec / 1000000000;
+}
+
 void sleep_time(double duration);
 
+int cpu_node(int cpu);
+
 uint64_t fnv_64_buf(const void* buf, size_t len);
 inline uint64_t fnv_64(uint64_t in) { return fnv_64_buf(&in, sizeof(in)); }
 